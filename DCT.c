@@ -35,6 +35,10 @@
 //  so the block of data returned by this function is ready to use without further
 //  processing.
 //
+//  fdct_fast() is taken from jfdctfst.c of jpeglib. It's the faster, but less
+//  accurate AA&N algorithm, whose outputs are still scaled by the factors in
+//  fdct_fast_scales.
+//
 //  *************************************************************************************
 
 #include "DCT.h"
@@ -231,4 +235,141 @@ void fdct(DCTELEM * data)
         
         dataptr++;			/* advance pointer to next column */
     }
-}
\ No newline at end of file
+}
+
+/*
+ * Fast forward DCT after Arai, Agui and Nakajima. Most of the multiplications
+ * of the DCT are left to the quantization step: output k is 8 * fdct_fast_scales[k] / 2^14
+ * times the true DCT coefficient.
+ */
+
+const INT32 fdct_fast_scales[64] = {
+    16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+    22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270,
+    21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906,
+    19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315,
+    16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+    12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552,
+     8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446,
+     4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247
+};
+
+#define FAST_CONST_BITS  8
+
+#define FAST_FIX_0_382683433  ((INT32)   98)	/* FIX(0.382683433) */
+#define FAST_FIX_0_541196100  ((INT32)  139)	/* FIX(0.541196100) */
+#define FAST_FIX_0_707106781  ((INT32)  181)	/* FIX(0.707106781) */
+#define FAST_FIX_1_306562965  ((INT32)  334)	/* FIX(1.306562965) */
+
+/* No rounding here, the errors are small compared to the quantization */
+#define FAST_MULTIPLY(var,const)  ((DCTELEM) RIGHT_SHIFT((var) * (const), FAST_CONST_BITS))
+
+void fdct_fast(DCTELEM * data)
+{
+    DCTELEM tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    DCTELEM tmp10, tmp11, tmp12, tmp13;
+    DCTELEM z1, z2, z3, z4, z5, z11, z13;
+    DCTELEM *dataptr;
+    int ctr;
+    SHIFT_TEMPS
+    
+    /* Pass 1: process rows. */
+    
+    dataptr = data;
+    for (ctr = 8-1; ctr >= 0; ctr--) {
+        tmp0 = dataptr[0] + dataptr[7];
+        tmp7 = dataptr[0] - dataptr[7];
+        tmp1 = dataptr[1] + dataptr[6];
+        tmp6 = dataptr[1] - dataptr[6];
+        tmp2 = dataptr[2] + dataptr[5];
+        tmp5 = dataptr[2] - dataptr[5];
+        tmp3 = dataptr[3] + dataptr[4];
+        tmp4 = dataptr[3] - dataptr[4];
+        
+        /* Even part */
+        
+        tmp10 = tmp0 + tmp3;	/* phase 2 */
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+        
+        dataptr[0] = tmp10 + tmp11; /* phase 3 */
+        dataptr[4] = tmp10 - tmp11;
+        
+        z1 = FAST_MULTIPLY(tmp12 + tmp13, FAST_FIX_0_707106781); /* c4 */
+        dataptr[2] = tmp13 + z1;	/* phase 5 */
+        dataptr[6] = tmp13 - z1;
+        
+        /* Odd part */
+        
+        tmp10 = tmp4 + tmp5;	/* phase 2 */
+        tmp11 = tmp5 + tmp6;
+        tmp12 = tmp6 + tmp7;
+        
+        /* The rotator is modified from fig 4-8 to avoid extra negations. */
+        z5 = FAST_MULTIPLY(tmp10 - tmp12, FAST_FIX_0_382683433); /* c6 */
+        z2 = FAST_MULTIPLY(tmp10, FAST_FIX_0_541196100) + z5; /* c2-c6 */
+        z4 = FAST_MULTIPLY(tmp12, FAST_FIX_1_306562965) + z5; /* c2+c6 */
+        z3 = FAST_MULTIPLY(tmp11, FAST_FIX_0_707106781); /* c4 */
+        
+        z11 = tmp7 + z3;		/* phase 5 */
+        z13 = tmp7 - z3;
+        
+        dataptr[5] = z13 + z2;	/* phase 6 */
+        dataptr[3] = z13 - z2;
+        dataptr[1] = z11 + z4;
+        dataptr[7] = z11 - z4;
+        
+        dataptr += 8;		/* advance pointer to next row */
+    }
+    
+    /* Pass 2: process columns. */
+    
+    dataptr = data;
+    for (ctr = 8-1; ctr >= 0; ctr--) {
+        tmp0 = dataptr[8*0] + dataptr[8*7];
+        tmp7 = dataptr[8*0] - dataptr[8*7];
+        tmp1 = dataptr[8*1] + dataptr[8*6];
+        tmp6 = dataptr[8*1] - dataptr[8*6];
+        tmp2 = dataptr[8*2] + dataptr[8*5];
+        tmp5 = dataptr[8*2] - dataptr[8*5];
+        tmp3 = dataptr[8*3] + dataptr[8*4];
+        tmp4 = dataptr[8*3] - dataptr[8*4];
+        
+        /* Even part */
+        
+        tmp10 = tmp0 + tmp3;	/* phase 2 */
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+        
+        dataptr[8*0] = tmp10 + tmp11; /* phase 3 */
+        dataptr[8*4] = tmp10 - tmp11;
+        
+        z1 = FAST_MULTIPLY(tmp12 + tmp13, FAST_FIX_0_707106781); /* c4 */
+        dataptr[8*2] = tmp13 + z1; /* phase 5 */
+        dataptr[8*6] = tmp13 - z1;
+        
+        /* Odd part */
+        
+        tmp10 = tmp4 + tmp5;	/* phase 2 */
+        tmp11 = tmp5 + tmp6;
+        tmp12 = tmp6 + tmp7;
+        
+        /* The rotator is modified from fig 4-8 to avoid extra negations. */
+        z5 = FAST_MULTIPLY(tmp10 - tmp12, FAST_FIX_0_382683433); /* c6 */
+        z2 = FAST_MULTIPLY(tmp10, FAST_FIX_0_541196100) + z5; /* c2-c6 */
+        z4 = FAST_MULTIPLY(tmp12, FAST_FIX_1_306562965) + z5; /* c2+c6 */
+        z3 = FAST_MULTIPLY(tmp11, FAST_FIX_0_707106781); /* c4 */
+        
+        z11 = tmp7 + z3;		/* phase 5 */
+        z13 = tmp7 - z3;
+        
+        dataptr[8*5] = z13 + z2; /* phase 6 */
+        dataptr[8*3] = z13 - z2;
+        dataptr[8*1] = z11 + z4;
+        dataptr[8*7] = z11 - z4;
+        
+        dataptr++;			/* advance pointer to next column */
+    }
+}
@@ -54,4 +54,9 @@
 
 void fdct(DCTELEM * data);
 
+// Faster, less accurate DCT, whose outputs still have to be divided by
+// 8 * fdct_fast_scales[k] / 2^14
+void fdct_fast(DCTELEM * data);
+extern const INT32 fdct_fast_scales[64];
+
 #endif /* DCT_h */
@@ -53,6 +53,15 @@
 #define ERR_RLC_BUFFER_OVERFLOW             -15
 #define ERR_NO_HUFFMAN_CODE_FOR_SYMBOL		-16
 #define ERR_INVALID_SAMPLING_FACTOR         -17
+#define ERR_INVALID_NUMBER_OF_ROWS          -18
+#define ERR_OUTPUT_BUFFER_TOO_SMALL         -19
+#define ERR_WRITE_CALLBACK_FAILED           -20
+#define ERR_INVALID_RESTART_INTERVAL        -21
+#define ERR_INVALID_SETTINGS                -22
+#define ERR_INVALID_SCAN_SCRIPT             -23
+#define ERR_INVALID_SCAN_PARAMETERS         -24
+#define ERR_NEED_MORE_DATA                  -25
+#define ERR_ENCODE_NOT_BEGUN                -26
 
 #define MAX_DC_TABLES 4
 #define MAX_AC_TABLES 4
@@ -65,9 +74,8 @@ typedef unsigned short word;
 
 struct jpeg_component
 {
-    // we can store this globally since we only support baseline
-    // jpegs with only one scan. otherwise this must be stored
-    // per scan.
+    // set by every SOS, progressive jpegs may switch tables
+    // between scans
     byte id_dht;
     int width, height;
     int stride;
@@ -75,6 +83,10 @@ struct jpeg_component
     byte qt_table;
     byte *pixels;
     int prev_dc;
+    // progressive or coefficient output only: quantized coefficients
+    // in natural order for every block of the MCU-padded component plane
+    short *coefs;
+    int blocks_x, blocks_y;
 };
 
 struct jpeg_huffman_code
@@ -116,6 +128,32 @@ struct jpeg_sof0
 
 #pragma pack(pop)
 
+// Quantized DCT coefficients of one component, 64 per block in natural
+// (not zigzag) order, blocks_x * blocks_y blocks row by row. The plane
+// covers whole MCUs, so it can be larger than the component.
+struct jpeg_coefficient_plane
+{
+    short *coefs;
+    int blocks_x, blocks_y;
+    int sx, sy;
+    // quantization factors in natural order
+    byte quant_table[64];
+};
+
+// See icejpeg_read_coefficients() and icejpeg_encode_init_coefficients()
+struct jpeg_coefficients
+{
+    int width, height;
+    int num_components;
+    // set if they were read from a progressive file, not used when encoding
+    int progressive;
+    // APPn and COM segments of the file, markers included, which the
+    // encoder writes again; 0 for none
+    const unsigned char *metadata;
+    int metadata_size;
+    struct jpeg_coefficient_plane planes[3];
+};
+
 extern const byte jpeg_zzleft[];
 extern const byte jpeg_zzright[];
 
@@ -27,8 +27,9 @@
 //  written mainly because I wanted to understand the inner workings of the
 //  JPEG format.
 //
-//  Currently, only baseline JPEGs are supported. However, I would like to implement
-//  progressive decompressiom as well at some point.
+//  Baseline and progressive JPEGs are supported. Progressive scans are decoded into
+//  a coefficient buffer per component, the image is reconstructed from it at the end
+//  or, if a scan callback is set, after every scan.
 //
 //  Only grayscale and RGB JPEGs can be decoded using this code.
 //
@@ -60,12 +61,23 @@ static struct __ice_decode_env
 {
 	byte *buffer;
 	int buf_pos;
+	int buf_size;
+	int buf_capacity;
 	word cur_segment_len;
 
 	byte cur_byte_remaining;
 
 	byte max_samp_x, max_samp_y;
-	int eoi;
+	int soi, eoi;
+	// a scan has been started but not finished yet
+	int in_scan;
+	// set by fetch_bits() when it runs past the data received so far
+	int out_of_data;
+	// stop after Huffman decoding, see icejpeg_read_coefficients()
+	int coefficients_only;
+	// copies of the APPn and COM segments, only kept along with the coefficients
+	byte *metadata;
+	int metadata_size;
 	int block[64];
 	int mcu_width, mcu_height;
 	int num_mcu_x, num_mcu_y;
@@ -89,8 +101,31 @@ static struct __ice_decode_env
 
 	// as read from the file
 	struct jpeg_sof0 sof0;
+
+	// progressive decoding: parameters of the current scan
+	int progressive;
+	int scan_num_components;
+	byte scan_components[3];
+	byte scan_ss, scan_se, scan_ah, scan_al;
+	int eobrun;
+	int num_scans;
+	icejpeg_scan_callback scan_callback;
+	void *scan_callback_user;
 } iceenv;
 
+// Bit reader and predictor state at the start of an MCU, restored when
+// the MCU runs out of data so it can be decoded again later
+struct jpeg_decode_checkpoint
+{
+    int buf_pos;
+    byte cur_byte_remaining;
+    int prev_dc[3];
+    int eobrun;
+};
+
+// Up to 3 components with sampling factors of up to 4x4
+#define MAX_MCU_BLOCKS 48
+
 #pragma pack(push)
 #pragma pack(1)
 
@@ -102,7 +137,11 @@ static struct __ice_decode_env
 
 void cleanup(void);
 int process_segment(void);
+int keep_segment(void);
 void cleanup_dht(void);
+void free_huffman_table(jpeg_huffman_table table);
+int upsample(void);
+int create_image(void);
 
 int icejpeg_decode_init(const char* filename)
 {
@@ -117,6 +156,7 @@ int icejpeg_decode_init(const char* filename)
     fstat(fileno(file), &st);
     
     iceenv.buffer = (byte *)malloc(sizeof(byte) * st.st_size);
+    iceenv.buf_size = iceenv.buf_capacity = (int)st.st_size;
     fread((void*)iceenv.buffer, sizeof(byte), st.st_size, file);
     
 #ifdef _JPEG_DEBUG
@@ -126,11 +166,12 @@ int icejpeg_decode_init(const char* filename)
     
     fclose(file);
     
-    if (iceenv.buffer[iceenv.buf_pos++] != 0xFF || iceenv.buffer[iceenv.buf_pos++] != 0xD8)
+    if (iceenv.buf_size < 2 || iceenv.buffer[iceenv.buf_pos++] != 0xFF || iceenv.buffer[iceenv.buf_pos++] != 0xD8)
     {
         cleanup();
         return ERR_NO_JPEG;
     }
+    iceenv.soi = 1;
     
     int i;
     for (i = 0; i < MAX_DC_TABLES; i++)
@@ -173,6 +214,110 @@ int icejpeg_read(unsigned char **buffer, int *width, int *height, int *num_compo
     return ERR_OK;
 }
 
+int icejpeg_decode_begin(void)
+{
+	memset(&iceenv, 0, sizeof(struct __ice_decode_env));
+    iceenv.cur_byte_remaining = 8;
+    
+    return ERR_OK;
+}
+
+int icejpeg_decode_push(const unsigned char *data, int size)
+{
+    if (size < 0)
+        return ERR_INVALID_LENGTH;
+    
+    // Everything before buf_pos has been consumed: decoding always stops
+    // at the start of a segment or an MCU
+    if (iceenv.buf_pos > 0)
+    {
+        memmove((void*)iceenv.buffer, (void*)(iceenv.buffer + iceenv.buf_pos), iceenv.buf_size - iceenv.buf_pos);
+        iceenv.buf_size -= iceenv.buf_pos;
+        iceenv.buf_pos = 0;
+    }
+    
+    if (iceenv.buf_size + size > iceenv.buf_capacity)
+    {
+        int capacity = max(iceenv.buf_capacity * 2, iceenv.buf_size + size);
+        byte *buffer = (byte*)realloc((void*)iceenv.buffer, capacity);
+        if (!buffer)
+            return ERR_OUT_OF_MEMORY;
+        iceenv.buffer = buffer;
+        iceenv.buf_capacity = capacity;
+    }
+    memcpy((void*)(iceenv.buffer + iceenv.buf_size), (void*)data, size);
+    iceenv.buf_size += size;
+    
+    if (!iceenv.soi)
+    {
+        if (iceenv.buf_size < 2)
+            return ERR_NEED_MORE_DATA;
+        if (iceenv.buffer[0] != 0xFF || iceenv.buffer[1] != 0xD8)
+            return ERR_NO_JPEG;
+        iceenv.buf_pos = 2;
+        iceenv.soi = 1;
+    }
+    
+    while (!iceenv.eoi)
+    {
+        int err = process_segment();
+        if (err != ERR_OK)
+            return err;
+    }
+    
+    return ERR_OK;
+}
+
+int icejpeg_read_coefficients(struct jpeg_coefficients *coefficients)
+{
+    int i, k, err;
+    
+    // Pixels and coefficients can't be mixed once the frame header is read
+    if (iceenv.components && !iceenv.coefficients_only)
+        return ERR_INVALID_SETTINGS;
+    iceenv.coefficients_only = 1;
+    
+    while (!iceenv.eoi)
+    {
+        err = process_segment();
+        if (err != ERR_OK)
+            return err;
+    }
+    
+    if (!iceenv.components)
+        return ERR_SOF0_MISSING;
+    
+    coefficients->width = iceenv.sof0.width;
+    coefficients->height = iceenv.sof0.height;
+    coefficients->num_components = iceenv.sof0.num_components;
+    coefficients->progressive = iceenv.progressive;
+    coefficients->metadata = iceenv.metadata;
+    coefficients->metadata_size = iceenv.metadata_size;
+    for (i = 0; i < iceenv.sof0.num_components; i++)
+    {
+        struct jpeg_component *c = &iceenv.components[i];
+        struct jpeg_coefficient_plane *plane = &coefficients->planes[i];
+        byte *qt = c->qt_table < 4 ? iceenv.qt_tables[c->qt_table] : 0;
+        
+        plane->coefs = c->coefs;
+        plane->blocks_x = c->blocks_x;
+        plane->blocks_y = c->blocks_y;
+        plane->sx = c->sx;
+        plane->sy = c->sy;
+        // DQT segments are in zigzag order
+        for (k = 0; k < 64; k++)
+            plane->quant_table[jpeg_zzright[k]] = qt ? qt[k] : 0;
+    }
+    
+    return ERR_OK;
+}
+
+void icejpeg_set_scan_callback(icejpeg_scan_callback callback, void *user)
+{
+    iceenv.scan_callback = callback;
+    iceenv.scan_callback_user = user;
+}
+
 void icejpeg_cleanup(void)
 {
     cleanup();
@@ -221,12 +366,15 @@ int gen_huffman_tables(void)
         cur_dst_table = (jpeg_huffman_table)malloc(sizeof(struct jpeg_huffman_code*) * 0xFFFF);
         memset((void*)cur_dst_table, 0, sizeof(struct jpeg_huffman_code*) * 0xFFFF);
         
+        // A DHT between scans replaces the table with the same id
         if (i >= 0 && i < MAX_DC_TABLES)
         {
+            free_huffman_table(iceenv.huff_dc[i]);
             iceenv.huff_dc[i] = cur_dst_table;
         }
         else
         {
+            free_huffman_table(iceenv.huff_ac[i - MAX_DC_TABLES]);
             iceenv.huff_ac[i - MAX_DC_TABLES] = cur_dst_table;
         }
         
@@ -277,6 +425,12 @@ word fetch_bits(int num_bits)
     byte bits_from_cur_byte = 0;
     while (num_bits > 0)
     {
+        if (iceenv.buf_pos >= iceenv.buf_size)
+        {
+            iceenv.out_of_data = 1;
+            return 0;
+        }
+        
         byte mask = 0;
         bits_from_cur_byte = min(iceenv.cur_byte_remaining, num_bits);
         byte mask_shift = iceenv.cur_byte_remaining - bits_from_cur_byte;
@@ -293,6 +447,12 @@ word fetch_bits(int num_bits)
         {
             if (iceenv.buffer[iceenv.buf_pos] == 0xFF)
             {
+                // Can't tell a stuff byte from a marker yet
+                if (iceenv.buf_pos + 1 >= iceenv.buf_size)
+                {
+                    iceenv.out_of_data = 1;
+                    return 0;
+                }
                 switch (iceenv.buffer[iceenv.buf_pos + 1])
                 {
                     case 0x00:
@@ -349,7 +509,7 @@ byte get_next_code(jpeg_huffman_table cur_table)
     byte cur_code = 0;
     int found = 0;
     
-    while (cur_length < 17)
+    while (cur_length < 17 && !iceenv.out_of_data)
     {
         bit_string <<= 1;
         bit_string |= fetch_bits(1);
@@ -363,7 +523,7 @@ byte get_next_code(jpeg_huffman_table cur_table)
         cur_length++;
     }
     
-    if (!found)
+    if (!found && !iceenv.out_of_data)
     {
         printf("No code found!\n");
         getc(stdin);
@@ -425,6 +585,21 @@ int process_dqt(void)
     return ERR_OK;
 }
 
+// Sets the size of a component plane as given by the frame header and
+// (re)allocates its pixels, upsampling replaces both. Without pixels when
+// only the coefficients are read
+void init_component_plane(int comp)
+{
+    struct jpeg_component *c = &iceenv.components[comp];
+    
+    c->width = (iceenv.sof0.width * c->sx + iceenv.max_samp_x - 1) / iceenv.max_samp_x;
+    c->height = (iceenv.sof0.height * c->sy + iceenv.max_samp_y - 1) / iceenv.max_samp_y;
+    c->stride = iceenv.num_mcu_x * (c->sx << 3);
+    
+    free((void*)c->pixels);
+    c->pixels = iceenv.coefficients_only ? 0 : (byte*)malloc(c->stride * (iceenv.num_mcu_y * (c->sy << 3)) * sizeof(byte));
+}
+
 int process_sof0(void)
 {
     iceenv.max_samp_y = iceenv.max_samp_x = 0;
@@ -448,6 +623,7 @@ int process_sof0(void)
     // 	}
     
 	iceenv.components = (struct jpeg_component*) malloc(sizeof(struct jpeg_component) * iceenv.sof0.num_components);
+    memset((void*)iceenv.components, 0, sizeof(struct jpeg_component) * iceenv.sof0.num_components);
     
     for (i = 0; i < iceenv.sof0.num_components; i++)
     {
@@ -474,10 +650,19 @@ int process_sof0(void)
     
     for (i = 0; i < iceenv.sof0.num_components; i++)
     {
-		iceenv.components[i].width = (iceenv.sof0.width * iceenv.components[i].sx + iceenv.max_samp_x - 1) / iceenv.max_samp_x;
-		iceenv.components[i].height = (iceenv.sof0.height * iceenv.components[i].sy + iceenv.max_samp_y - 1) / iceenv.max_samp_y;
-		iceenv.components[i].stride = iceenv.num_mcu_x * (iceenv.components[i].sx << 3);
-		iceenv.components[i].pixels = (byte*)malloc(iceenv.components[i].stride * (iceenv.num_mcu_y * (iceenv.components[i].sy << 3)) * sizeof(byte));
+        init_component_plane(i);
+        
+        if (!iceenv.progressive && !iceenv.coefficients_only)
+            continue;
+        
+        // Progressive scans refine the coefficients of the whole image,
+        // so they are kept until the picture is reconstructed
+        iceenv.components[i].blocks_x = iceenv.num_mcu_x * iceenv.components[i].sx;
+        iceenv.components[i].blocks_y = iceenv.num_mcu_y * iceenv.components[i].sy;
+        iceenv.components[i].coefs = (short*)malloc(iceenv.components[i].blocks_x * iceenv.components[i].blocks_y * 64 * sizeof(short));
+        if (!iceenv.components[i].coefs)
+            return ERR_OUT_OF_MEMORY;
+        memset((void*)iceenv.components[i].coefs, 0, iceenv.components[i].blocks_x * iceenv.components[i].blocks_y * 64 * sizeof(short));
     }
     
 #ifdef _JPEG_DEBUG
@@ -548,15 +733,38 @@ int process_sos(void)
     if (!iceenv.components)
         return ERR_SOF0_MISSING;
     
+    if (num_components < 1 || num_components > iceenv.sof0.num_components)
+        return ERR_INVALID_SCAN_PARAMETERS;
+    
     int i = 0;
     for (i = 0; i < num_components; i++)
     {
         byte id = iceenv.buffer[iceenv.buf_pos++];
+        if (id < 1 || id > iceenv.sof0.num_components)
+            return ERR_INVALID_SCAN_PARAMETERS;
 		iceenv.components[id-1].id_dht = iceenv.buffer[iceenv.buf_pos++];
+        iceenv.scan_components[i] = id - 1;
     }
+    iceenv.scan_num_components = num_components;
+    
+    // Spectral selection and successive approximation, only
+    // meaningful for progressive jpegs
+    iceenv.scan_ss = iceenv.buffer[iceenv.buf_pos++];
+    iceenv.scan_se = iceenv.buffer[iceenv.buf_pos++];
+    iceenv.scan_ah = UPR4(iceenv.buffer[iceenv.buf_pos]);
+    iceenv.scan_al = LWR4(iceenv.buffer[iceenv.buf_pos++]);
+    
+    if (!iceenv.progressive)
+        return ERR_OK;
     
-    // Ignore the following 3 bytes
-    iceenv.buf_pos += 3;
+    // DC and AC coefficients can't share a scan and AC scans
+    // can only contain one component
+    if (iceenv.scan_ss > iceenv.scan_se || iceenv.scan_se > 63 || iceenv.scan_al > 13)
+        return ERR_INVALID_SCAN_PARAMETERS;
+    if (iceenv.scan_ss == 0 && iceenv.scan_se != 0)
+        return ERR_INVALID_SCAN_PARAMETERS;
+    if (iceenv.scan_ss > 0 && num_components != 1)
+        return ERR_INVALID_SCAN_PARAMETERS;
     
     return ERR_OK;
 }
@@ -573,12 +781,35 @@ int process_dri(void)
 }
 
 // Decode a single DU within an MCU
+// Dequantizes and unzigzags a block of quantized coefficients at the same
+// time and performs the IDCT
+void transform_block(const short *coef, const byte *qt, byte *dst, int stride)
+{
+    int k, rowscols;
+    
+    for (k = 0; k < 64; k++)
+        iceenv.block[jpeg_zzright[k]] = coef[jpeg_zzright[k]] * qt[k];
+    
+    for (rowscols = 0; rowscols < 8; rowscols++)
+        idctrow(&iceenv.block[8 * rowscols]);
+    for (rowscols = 0; rowscols < 8; rowscols++)
+        idctcol(&iceenv.block[rowscols], dst + rowscols, stride);
+}
+
 int decode_du(byte id_component)
 {
     word bit_string = 0;
     byte cur_code = 0;
+    struct jpeg_component *c = &iceenv.components[id_component];
+    
+    // Quantized coefficients in natural order, kept in the component's
+    // plane when only those are wanted
+    short du_coefs[64];
+    short *coef = du_coefs;
+    if (iceenv.coefficients_only)
+        coef = c->coefs + ((((iceenv.cur_mcu_y * c->sy) + iceenv.cur_du_y) * c->blocks_x) + (iceenv.cur_mcu_x * c->sx) + iceenv.cur_du_x) * 64;
     
-    memset(iceenv.block, 0, sizeof(int) * 64);
+    memset(coef, 0, sizeof(short) * 64);
     
     jpeg_huffman_table cur_table = iceenv.huff_dc[UPR4(iceenv.components[id_component].id_dht)];
     
@@ -598,15 +829,12 @@ int decode_du(byte id_component)
     
 	iceenv.components[id_component].prev_dc += value;
     //mcu->dus[id_component][(y*samp_x) + x][0] = cur_mcu > 0 ? (mcus[cur_mcu - 1].dus[id_component][(y*samp_x) + x][0] + dc_value) : dc_value;
-	iceenv.block[0] = iceenv.components[id_component].prev_dc;
+	coef[0] = iceenv.components[id_component].prev_dc;
     
 #ifdef _JPEG_DEBUG
-    printf("DC value: %d, absolute value: %d\n", block[0], value);
+    printf("DC value: %d, absolute value: %d\n", coef[0], value);
 #endif
     
-    // Dequantize DC value
-	iceenv.block[0] *= iceenv.qt_tables[iceenv.components[id_component].qt_table][0];
-    
     // Switch to AC table
     cur_table = iceenv.huff_ac[LWR4(iceenv.components[id_component].id_dht)];
     
@@ -648,19 +876,12 @@ int decode_du(byte id_component)
     printf("AC value: %d\n", value);
 #endif
         
-        byte actual_index = jpeg_zzright[block_index];
-        
-        
-        // Dequantize and unzigzag at the same time
-		iceenv.block[actual_index] = value * iceenv.qt_tables[iceenv.components[id_component].qt_table][block_index];
+        // Unzigzag
+		coef[jpeg_zzright[block_index]] = value;
         block_index++;
-        
-#ifdef _JPEG_DEBUG
-    printf("Dequantized AC value: %d\n", block[actual_index]);
-#endif
     }
     
-    if (block_index > 64)
+    if (block_index > 64 && !iceenv.out_of_data)
     {
         printf("CAUTION: Too many coefs in MCU [%d,%d]\n", iceenv.cur_mcu_x, iceenv.cur_mcu_y);
         getc(stdin);
@@ -670,19 +891,12 @@ int decode_du(byte id_component)
     printf("\n");
 #endif
     
-    /****************************************************/
-    /* Perform IDCT                                     */
-    /****************************************************/
-    int rowscols;
-    for (rowscols = 0; rowscols < 8; rowscols++)
-    {
-        idctrow(&iceenv.block[8 * rowscols]);
-    }
-    for (rowscols = 0; rowscols < 8; rowscols++)
-    {
-        int targetPos = ((iceenv.cur_mcu_y * (iceenv.components[id_component].sy << 3) + (iceenv.cur_du_y << 3)) * iceenv.components[id_component].stride) + (iceenv.cur_mcu_x * (iceenv.components[id_component].sx << 3) + (iceenv.cur_du_x << 3));
-        idctcol(&iceenv.block[rowscols], &iceenv.components[id_component].pixels[targetPos + rowscols], iceenv.components[id_component].stride);
-    }
+    // A block cut short is decoded again once there's more data
+    if (iceenv.coefficients_only || iceenv.out_of_data)
+        return ERR_OK;
+    
+    int targetPos = ((iceenv.cur_mcu_y * (c->sy << 3) + (iceenv.cur_du_y << 3)) * c->stride) + (iceenv.cur_mcu_x * (c->sx << 3) + (iceenv.cur_du_x << 3));
+    transform_block(coef, iceenv.qt_tables[c->qt_table], &c->pixels[targetPos], c->stride);
     
     return ERR_OK;
 }
@@ -707,11 +921,58 @@ int decode_mcu(void)
     return ERR_OK;
 }
 
-int process_rst(void)
+// Skips the rest of the current byte and any fill bytes, leaving
+// buf_pos at the next marker
+int skip_to_marker(void)
 {
-    iceenv.buf_pos++;
+    int pos = iceenv.buf_pos;
+    
+    if (iceenv.cur_byte_remaining < 8)
+        pos++;
+    while (pos + 1 < iceenv.buf_size &&
+           (iceenv.buffer[pos] != 0xFF || iceenv.buffer[pos + 1] == 0x00 || iceenv.buffer[pos + 1] == 0xFF))
+        pos++;
+    
+    // The marker hasn't arrived yet
+    if (pos + 1 >= iceenv.buf_size)
+        return ERR_NEED_MORE_DATA;
+    
+    iceenv.buf_pos = pos;
     iceenv.cur_byte_remaining = 8;
     
+    return ERR_OK;
+}
+
+void save_checkpoint(struct jpeg_decode_checkpoint *checkpoint)
+{
+    int i;
+    
+    checkpoint->buf_pos = iceenv.buf_pos;
+    checkpoint->cur_byte_remaining = iceenv.cur_byte_remaining;
+    checkpoint->eobrun = iceenv.eobrun;
+    for (i = 0; i < iceenv.sof0.num_components; i++)
+        checkpoint->prev_dc[i] = iceenv.components[i].prev_dc;
+    
+    iceenv.out_of_data = 0;
+}
+
+void restore_checkpoint(const struct jpeg_decode_checkpoint *checkpoint)
+{
+    int i;
+    
+    iceenv.buf_pos = checkpoint->buf_pos;
+    iceenv.cur_byte_remaining = checkpoint->cur_byte_remaining;
+    iceenv.eobrun = checkpoint->eobrun;
+    for (i = 0; i < iceenv.sof0.num_components; i++)
+        iceenv.components[i].prev_dc = checkpoint->prev_dc[i];
+}
+
+int process_rst(void)
+{
+    int err = skip_to_marker();
+    if (err != ERR_OK)
+        return err;
+    
     if (iceenv.buffer[iceenv.buf_pos++] != 0xFF || (LWR4(iceenv.buffer[iceenv.buf_pos++])) != iceenv.next_rst_marker)
     {
         return ERR_INVALID_RST_MARKER;
@@ -720,6 +981,7 @@ int process_rst(void)
     iceenv.next_rst_marker = (iceenv.next_rst_marker + 1) & 7;
     
     iceenv.rstcount = iceenv.restart_interval;
+    iceenv.eobrun = 0;
     
     int i = 0;
     for (;i<iceenv.sof0.num_components;i++)
@@ -738,36 +1000,367 @@ int decode_scan(void)
 //    if (iceenv.scan_buffer[iceenv.buf_pos] == 0xFF && iceenv.scan_buffer[iceenv.buf_pos + 1] == 0x00)
 //        skip_stuff_byte = 1;
     
-    init_idct();
+    struct jpeg_decode_checkpoint checkpoint;
     
-    for (iceenv.cur_mcu_x = iceenv.cur_mcu_y = 0;;)
+    // Continues where the last call ran out of data
+    while (iceenv.cur_mcu_y < iceenv.num_mcu_y)
     {
-            //printf("Decoding MCU [%d,%d]\n", iceenv.cur_mcu_x, iceenv.cur_mcu_y);
-            decode_mcu();
+        if (iceenv.restart_interval && !iceenv.rstcount)
+        {
+            int err = process_rst();
+            if (err != ERR_OK)
+                return err;
+        }
         
-            iceenv.cur_mcu_x++;
-            if (iceenv.cur_mcu_x == iceenv.num_mcu_x)
+        //printf("Decoding MCU [%d,%d]\n", iceenv.cur_mcu_x, iceenv.cur_mcu_y);
+        save_checkpoint(&checkpoint);
+        decode_mcu();
+        if (iceenv.out_of_data)
+        {
+            restore_checkpoint(&checkpoint);
+            return ERR_NEED_MORE_DATA;
+        }
+        
+        iceenv.rstcount--;
+        iceenv.cur_mcu_x++;
+        if (iceenv.cur_mcu_x == iceenv.num_mcu_x)
+        {
+            iceenv.cur_mcu_x = 0;
+            iceenv.cur_mcu_y++;
+        }
+    }
+    
+    return skip_to_marker();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Progressive decoding
+//////////////////////////////////////////////////////////////////////////
+
+// Fetches a value of the given size category and extends its sign
+int receive_extend(byte length)
+{
+    if (!length)
+        return 0;
+    return get_signed_short(fetch_bits(length), length);
+}
+
+int decode_dc_first(byte id_component, short *coef)
+{
+    byte cur_code = get_next_code(iceenv.huff_dc[UPR4(iceenv.components[id_component].id_dht)]);
+    
+    iceenv.components[id_component].prev_dc += receive_extend(cur_code);
+    coef[0] = (short)(iceenv.components[id_component].prev_dc * (1 << iceenv.scan_al));
+    
+    return ERR_OK;
+}
+
+int decode_dc_refine(short *coef)
+{
+    if (fetch_bits(1))
+        coef[0] |= 1 << iceenv.scan_al;
+    
+    return ERR_OK;
+}
+
+int decode_ac_first(byte id_component, short *coef)
+{
+    jpeg_huffman_table cur_table = iceenv.huff_ac[LWR4(iceenv.components[id_component].id_dht)];
+    int k;
+    
+    // Block lies within a run of empty blocks
+    if (iceenv.eobrun > 0)
+    {
+        iceenv.eobrun--;
+        return ERR_OK;
+    }
+    
+    for (k = iceenv.scan_ss; k <= iceenv.scan_se; k++)
+    {
+        byte cur_code = get_next_code(cur_table);
+        byte run = UPR4(cur_code);
+        byte size = LWR4(cur_code);
+        
+        if (size)
+        {
+            k += run;
+            if (k > iceenv.scan_se)
+                break;
+            coef[jpeg_zzright[k]] = (short)(receive_extend(size) * (1 << iceenv.scan_al));
+        }
+        else if (run == 15)
+        {
+            // ZRL
+            k += 15;
+        }
+        else
+        {
+            // EOBn: this block and the next 2^n-1+bits blocks are done
+            iceenv.eobrun = 1 << run;
+            if (run)
+                iceenv.eobrun += fetch_bits(run);
+            iceenv.eobrun--;
+            break;
+        }
+    }
+    
+    return ERR_OK;
+}
+
+// Appends a correction bit to a coefficient that is already nonzero
+void refine_coef(short *coef)
+{
+    short bit = 1 << iceenv.scan_al;
+    
+    if (fetch_bits(1) && !(*coef & bit))
+        *coef += *coef >= 0 ? bit : -bit;
+}
+
+int decode_ac_refine(byte id_component, short *coef)
+{
+    jpeg_huffman_table cur_table = iceenv.huff_ac[LWR4(iceenv.components[id_component].id_dht)];
+    int k = iceenv.scan_ss;
+    
+    if (!iceenv.eobrun)
+    {
+        for (; k <= iceenv.scan_se; k++)
+        {
+            byte cur_code = get_next_code(cur_table);
+            int run = UPR4(cur_code);
+            short value = 0;
+            
+            if (LWR4(cur_code))
+            {
+                // A coefficient that becomes nonzero, always +-1 at this bit position
+                value = fetch_bits(1) ? 1 << iceenv.scan_al : -(1 << iceenv.scan_al);
+            }
+            else if (run != 15)
+            {
+                iceenv.eobrun = 1 << run;
+                if (run)
+                    iceenv.eobrun += fetch_bits(run);
+                break;
+            }
+            
+            // Skip run zero coefficients, nonzero ones on the way
+            // receive a correction bit
+            while (k <= iceenv.scan_se)
             {
-                iceenv.cur_mcu_x = 0;
-                iceenv.cur_mcu_y++;
-                if (iceenv.cur_mcu_y == iceenv.num_mcu_y)
+                short *cur_coef = &coef[jpeg_zzright[k]];
+                if (*cur_coef)
+                    refine_coef(cur_coef);
+                else if (--run < 0)
                     break;
+                k++;
             }
-        
-            if (!iceenv.restart_interval)
-                continue;
             
-            iceenv.rstcount--;
-            if (!iceenv.rstcount)
+            if (value && k <= iceenv.scan_se)
+                coef[jpeg_zzright[k]] = value;
+        }
+    }
+    
+    if (iceenv.eobrun > 0)
+    {
+        // The rest of the band only receives correction bits
+        for (; k <= iceenv.scan_se; k++)
+        {
+            if (coef[jpeg_zzright[k]])
+                refine_coef(&coef[jpeg_zzright[k]]);
+        }
+        iceenv.eobrun--;
+    }
+    
+    return ERR_OK;
+}
+
+int decode_block_progressive(byte id_component, short *coef)
+{
+    if (iceenv.scan_ss == 0)
+        return iceenv.scan_ah ? decode_dc_refine(coef) : decode_dc_first(id_component, coef);
+    return iceenv.scan_ah ? decode_ac_refine(id_component, coef) : decode_ac_first(id_component, coef);
+}
+
+// Dequantizes and transforms the coefficients decoded so far and puts the
+// image together
+int reconstruct_image(void)
+{
+    int comp, bx, by;
+    
+    init_idct();
+    
+    for (comp = 0; comp < iceenv.sof0.num_components; comp++)
+    {
+        struct jpeg_component *c = &iceenv.components[comp];
+        byte *qt = iceenv.qt_tables[c->qt_table];
+        
+        init_component_plane(comp);
+        
+        for (by = 0; by < c->blocks_y; by++)
+        {
+            for (bx = 0; bx < c->blocks_x; bx++)
+            {
+                short *coef = c->coefs + ((by * c->blocks_x) + bx) * 64;
+                byte *dst = c->pixels + ((by << 3) * c->stride) + (bx << 3);
+                transform_block(coef, qt, dst, c->stride);
+            }
+        }
+    }
+    
+    upsample();
+    return create_image();
+}
+
+// Collects the blocks of the current MCU, a single block in
+// non-interleaved scans
+int get_mcu_blocks(short **blocks, byte *block_components)
+{
+    int i, n = 0;
+    
+    if (iceenv.scan_num_components == 1)
+    {
+        struct jpeg_component *c = &iceenv.components[iceenv.scan_components[0]];
+        blocks[0] = c->coefs + ((iceenv.cur_mcu_y * c->blocks_x) + iceenv.cur_mcu_x) * 64;
+        block_components[0] = iceenv.scan_components[0];
+        return 1;
+    }
+    
+    for (i = 0; i < iceenv.scan_num_components; i++)
+    {
+        byte comp = iceenv.scan_components[i];
+        struct jpeg_component *c = &iceenv.components[comp];
+        
+        for (iceenv.cur_du_y = 0; iceenv.cur_du_y < c->sy; iceenv.cur_du_y++)
+        {
+            for (iceenv.cur_du_x = 0; iceenv.cur_du_x < c->sx; iceenv.cur_du_x++)
             {
-                int err = process_rst();
-                if (err != ERR_OK)
-                    return err;
+                int block = ((iceenv.cur_mcu_y * c->sy + iceenv.cur_du_y) * c->blocks_x) + (iceenv.cur_mcu_x * c->sx + iceenv.cur_du_x);
+                blocks[n] = c->coefs + block * 64;
+                block_components[n++] = comp;
             }
+        }
     }
     
-    //if (iceenv.cur_byte_remaining > 0)
-    iceenv.buf_pos++;
+    return n;
+}
+
+int decode_progressive_scan(void)
+{
+    int num_x, num_y, i, n;
+    int err;
+    short *blocks[MAX_MCU_BLOCKS];
+    byte block_components[MAX_MCU_BLOCKS];
+    short backup[MAX_MCU_BLOCKS][64];
+    struct jpeg_decode_checkpoint checkpoint;
+    
+    if (iceenv.scan_num_components == 1)
+    {
+        // Non-interleaved scans only cover the blocks inside the component,
+        // not the MCU padding
+        struct jpeg_component *c = &iceenv.components[iceenv.scan_components[0]];
+        num_x = ((iceenv.sof0.width * c->sx + iceenv.max_samp_x - 1) / iceenv.max_samp_x + 7) >> 3;
+        num_y = ((iceenv.sof0.height * c->sy + iceenv.max_samp_y - 1) / iceenv.max_samp_y + 7) >> 3;
+    }
+    else
+    {
+        num_x = iceenv.num_mcu_x;
+        num_y = iceenv.num_mcu_y;
+    }
+    
+    // Continues where the last call ran out of data
+    while (iceenv.cur_mcu_y < num_y)
+    {
+        if (iceenv.restart_interval && !iceenv.rstcount)
+        {
+            err = process_rst();
+            if (err != ERR_OK)
+                return err;
+        }
+        
+        // Refinements change the coefficients in place, so they are
+        // backed up in case the MCU has to be decoded again
+        n = get_mcu_blocks(blocks, block_components);
+        save_checkpoint(&checkpoint);
+        for (i = 0; i < n; i++)
+        {
+            memcpy((void*)backup[i], (void*)blocks[i], 64 * sizeof(short));
+            decode_block_progressive(block_components[i], blocks[i]);
+        }
+        if (iceenv.out_of_data)
+        {
+            for (i = 0; i < n; i++)
+                memcpy((void*)blocks[i], (void*)backup[i], 64 * sizeof(short));
+            restore_checkpoint(&checkpoint);
+            return ERR_NEED_MORE_DATA;
+        }
+        
+        iceenv.rstcount--;
+        iceenv.cur_mcu_x++;
+        if (iceenv.cur_mcu_x == num_x)
+        {
+            iceenv.cur_mcu_x = 0;
+            iceenv.cur_mcu_y++;
+        }
+    }
+    
+    err = skip_to_marker();
+    if (err != ERR_OK)
+        return err;
+    
+    iceenv.num_scans++;
+    
+    if (!iceenv.scan_callback || iceenv.coefficients_only)
+        return ERR_OK;
+    
+    err = reconstruct_image();
+    if (err != ERR_OK)
+        return err;
+    
+    iceenv.scan_callback(iceenv.scan_callback_user, iceenv.image, iceenv.sof0.width, iceenv.sof0.height, iceenv.sof0.num_components, iceenv.num_scans);
+    
+    return ERR_OK;
+}
+
+void begin_scan(void)
+{
+    int i;
+    
+    init_idct();
+    
+    iceenv.cur_mcu_x = iceenv.cur_mcu_y = 0;
+    iceenv.cur_byte_remaining = 8;
+    iceenv.eobrun = 0;
+    iceenv.next_rst_marker = 0;
+    iceenv.rstcount = iceenv.restart_interval;
+    for (i = 0; i < iceenv.sof0.num_components; i++)
+        iceenv.components[i].prev_dc = 0;
+    
+    iceenv.in_scan = 1;
+}
+
+// Decodes the current scan as far as the data allows
+int continue_scan(void)
+{
+    int err;
+    
+    if (iceenv.progressive)
+    {
+        err = decode_progressive_scan();
+        if (err != ERR_OK)
+            return err;
+    }
+    else
+    {
+        err = decode_scan();
+        if (err != ERR_OK)
+            return err;
+        if (!iceenv.coefficients_only)
+        {
+            upsample();
+            create_image();
+        }
+    }
+    
+    iceenv.in_scan = 0;
     
     return ERR_OK;
 }
@@ -797,8 +1390,10 @@ int upsample(void)
 
 int create_image(void)
 {
-    // put image together
-	iceenv.image = (byte*) malloc((iceenv.sof0.width * iceenv.sof0.height) * iceenv.sof0.num_components);
+    // put image together, progressive jpegs reuse the image
+    // for every scan
+    if (!iceenv.image)
+		iceenv.image = (byte*) malloc((iceenv.sof0.width * iceenv.sof0.height) * iceenv.sof0.num_components);
     
 	if (iceenv.sof0.num_components == 3)
 	{
@@ -848,6 +1443,13 @@ int process_segment(void)
     word marker;
     int err;
     
+    if (iceenv.in_scan)
+        return continue_scan();
+    
+    // Segments are only processed once they are complete
+    if (iceenv.buf_pos + 2 > iceenv.buf_size)
+        return ERR_NEED_MORE_DATA;
+    
     marker = fetch_word();
     if (marker == 0xFFD9)
     {
@@ -855,15 +1457,32 @@ int process_segment(void)
 #ifdef _JPEG_DEBUG
         printf("EOI detected! Done.\n");
 #endif
+        // With a scan callback the image is already up to date
+        if (iceenv.progressive && !iceenv.scan_callback && !iceenv.coefficients_only)
+            return reconstruct_image();
         return ERR_OK;
     }
     
+    if (iceenv.buf_pos + 2 > iceenv.buf_size)
+    {
+        iceenv.buf_pos -= 2;
+        return ERR_NEED_MORE_DATA;
+    }
+    
     iceenv.cur_segment_len = fetch_word();
     
+    if (iceenv.buf_pos + iceenv.cur_segment_len - 2 > iceenv.buf_size)
+    {
+        iceenv.buf_pos -= 4;
+        return ERR_NEED_MORE_DATA;
+    }
+    
     switch (marker)
     {
         case 0xFFE0:
-            err = process_app0();
+            err = keep_segment();
+            if (err == ERR_OK)
+                err = process_app0();
             break;
         case 0xFFDB:
             err = process_dqt();
@@ -871,6 +1490,10 @@ int process_segment(void)
         case 0xFFC0:
             err = process_sof0();
             break;
+        case 0xFFC2:
+            iceenv.progressive = 1;
+            err = process_sof0();
+            break;
         case 0xFFC4:
             err = process_dht();
             break;
@@ -880,12 +1503,12 @@ int process_segment(void)
         case 0xFFDA:
             err = gen_huffman_tables();
             err = process_sos();
-            err = decode_scan();
-            err = upsample();
-            err = create_image();
+            if (err != ERR_OK)
+                break;
+            begin_scan();
+            err = continue_scan();
             break;
 		case 0xFFC1:
-		case 0xFFC2:
 		case 0xFFC3:
 		case 0xFFC5:
 		case 0xFFC6:
@@ -902,56 +1525,80 @@ int process_segment(void)
 #ifdef _JPEG_DEBUG
             printf("Skipping unknown segment %X\n", marker & 0xFF);
 #endif
+            // APP1-APP15 and COM
+            err = (marker >= 0xFFE1 && marker <= 0xFFEF) || marker == 0xFFFE ? keep_segment() : ERR_OK;
             iceenv.buf_pos += iceenv.cur_segment_len - 2;
-            err = ERR_OK;
             break;
     }
     
     return err;
 }
 
+// Copies the current segment, marker and length included, when only the
+// coefficients are read, so the encoder can write it again
+int keep_segment(void)
+{
+    byte *metadata;
+    
+    if (!iceenv.coefficients_only)
+        return ERR_OK;
+    if (iceenv.cur_segment_len < 2)
+        return ERR_INVALID_SEGMENT_SIZE;
+    
+    metadata = (byte*)realloc((void*)iceenv.metadata, iceenv.metadata_size + iceenv.cur_segment_len + 2);
+    if (!metadata)
+        return ERR_OUT_OF_MEMORY;
+    iceenv.metadata = metadata;
+    // The marker and the length have been read already
+    memcpy((void*)(iceenv.metadata + iceenv.metadata_size), (void*)(iceenv.buffer + iceenv.buf_pos - 4), iceenv.cur_segment_len + 2);
+    iceenv.metadata_size += iceenv.cur_segment_len + 2;
+    
+    return ERR_OK;
+}
+
 void cleanup_dht(void)
 {
     int i;
-    for (i = 0; i < 2; i++)
+    for (i = 0; i < MAX_DC_TABLES; i++)
     {
         if (iceenv.dc_dht[i])
         {
             free((void*)iceenv.dc_dht[i]->codes);
             free((void*)iceenv.dc_dht[i]);
+            iceenv.dc_dht[i] = 0;
         }
+    }
+    for (i = 0; i < MAX_AC_TABLES; i++)
+    {
         if (iceenv.ac_dht[i])
         {
             free((void*)iceenv.ac_dht[i]->codes);
             free((void*)iceenv.ac_dht[i]);
+            iceenv.ac_dht[i] = 0;
         }
     }
 }
 
-void cleanup_huffman_tables(void)
+void free_huffman_table(jpeg_huffman_table table)
 {
-    int i, j;
-    for (i = 0; i < 2; i++)
+    int j;
+    if (!table)
+        return;
+    for (j = 0; j < 0xFFFF; j++)
     {
-        if (iceenv.huff_dc[i])
-        {
-            for (j = 0; j < 0xFFFF; j++)
-            {
-                if (iceenv.huff_dc[i][j])
-                    free((void*)iceenv.huff_dc[i][j]);
-            }
-            free((void*)iceenv.huff_dc[i]);
-        }
-        if (iceenv.huff_ac[i])
-        {
-            for (j = 0; j < 0xFFFF; j++)
-            {
-                if (iceenv.huff_ac[i][j])
-                    free((void*)iceenv.huff_ac[i][j]);
-            }
-            free((void*)iceenv.huff_ac[i]);
-        }
+        if (table[j])
+            free((void*)table[j]);
     }
+    free((void*)table);
+}
+
+void cleanup_huffman_tables(void)
+{
+    int i;
+    for (i = 0; i < MAX_DC_TABLES; i++)
+        free_huffman_table(iceenv.huff_dc[i]);
+    for (i = 0; i < MAX_AC_TABLES; i++)
+        free_huffman_table(iceenv.huff_ac[i]);
 }
 
 void cleanup_qt_tables(void)
@@ -967,8 +1614,16 @@ void cleanup_qt_tables(void)
 void cleanup(void)
 {
     cleanup_qt_tables();
+    cleanup_dht();
     cleanup_huffman_tables();
     
+    int i;
+    for (i = 0; iceenv.components && i < iceenv.sof0.num_components; i++)
+    {
+        free((void*)iceenv.components[i].pixels);
+        free((void*)iceenv.components[i].coefs);
+    }
     free((void*)iceenv.components);
     free((void*)iceenv.buffer);
+    free((void*)iceenv.metadata);
 }
\ No newline at end of file
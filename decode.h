@@ -26,8 +26,31 @@
 #ifndef decode_h
 #define decode_h
 
+struct jpeg_coefficients;
+
+// Receives the image reconstructed from all scans decoded so far; the
+// buffer is only valid during the call
+typedef void (*icejpeg_scan_callback)(void *user, const unsigned char *image, int width, int height, int num_components, int scan);
+
 int icejpeg_decode_init(const char* filename);
 int icejpeg_read(unsigned char **buffer, int *width, int *height, int *num_components);
+
+// Incremental decoding: the file is handed over in chunks of any size.
+// icejpeg_decode_push() returns ERR_NEED_MORE_DATA until the whole image
+// has been decoded, after which icejpeg_read() returns it
+int icejpeg_decode_begin(void);
+int icejpeg_decode_push(const unsigned char *data, int size);
+
+// Stops after Huffman decoding and returns the quantized coefficients and
+// quantization tables instead of the image, valid until icejpeg_cleanup().
+// Replaces icejpeg_read(); when decoding incrementally it has to be called
+// before the frame header has been pushed and returns ERR_NEED_MORE_DATA
+// until the image is complete.
+int icejpeg_read_coefficients(struct jpeg_coefficients *coefficients);
+
+// Progressive jpegs only, must be called after icejpeg_decode_init() or
+// icejpeg_decode_begin()
+void icejpeg_set_scan_callback(icejpeg_scan_callback callback, void *user);
 void icejpeg_cleanup(void);
 
 
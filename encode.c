@@ -39,10 +39,30 @@
 //  Huffman tables, however, are generated on-the-fly for each image.
 //  For RGB images, 6 Huffman tables are generated: 3 for the DC value of each
 //  component and 3 for the AC values of each component.
+//  Alternatively the standard Huffman tables from Annex K can be used, which
+//  allows coding the image in a single pass.
+//  Presets in the settings choose between speed and file size by selecting
+//  the Huffman tables, a fast or an accurate DCT and a box or triangle filter
+//  for chroma downsampling.
 //
-//  Restart markers are supported as well. The restart interval cannot currently
-//  be set from the outside and, if restart is enabled, a restart marker will
-//  be output after each line of MCUs.
+//  Images can also be encoded incrementally, row by row, using
+//  icejpeg_encode_begin(), icejpeg_encode_write_rows() and icejpeg_encode_finish().
+//  In that case only one MCU row is buffered and the standard Huffman tables
+//  from Annex K are used, so every MCU row can be written out immediately.
+//
+//  The output goes to a file by default, but can be redirected into memory or
+//  to a callback with the icejpeg_set_output_*() functions.
+//
+//  Setting num_threads in the settings spreads the work over several threads.
+//  Color conversion, downsampling, transform and the gathering of the symbol
+//  statistics are done in bands of MCU rows. With restart markers enabled the
+//  restart intervals are independent of each other, so entropy coding of the
+//  intervals is parallelized as well. The output is the same no matter how
+//  many threads are used.
+//
+//  Restart markers are supported as well. By default a restart marker is
+//  output after each line of MCUs, but the interval can be set in the settings
+//  or chosen automatically to suit the number of threads.
 //
 //  The code that performs the DCT was taken from jpeglib which slight modifications.
 //
@@ -51,10 +71,12 @@
 #include "encode.h"
 #include "common.h"
 #include "DCT.h"
+#include "parallel.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdint.h>
 
 //#define _JPEG_ENCODER_DEBUG
 #define _JPEG_ENCODER_STATS
@@ -74,6 +96,34 @@
 #define CRG -107
 #define CRB -21
 
+// Number of entries of each worker's block cache, must be a power of 2
+#define BLOCK_CACHE_SIZE 1024
+
+// With sampled statistics, every HUFF_SAMPLE_STEP-th MCU row is sampled.
+// Images with fewer MCU rows than HUFF_SAMPLE_MIN_ROWS are sampled completely.
+#define HUFF_SAMPLE_STEP 4
+#define HUFF_SAMPLE_MIN_ROWS 16
+
+// Maximum depth of the Huffman tree before the code lengths are limited
+// to 16 bits. Symbol frequencies would have to grow like the Fibonacci
+// numbers beyond 32 bit ints to get deeper.
+#define HUFF_MAX_CODE_LENGTH 48
+
+// Number of quantization levels rate control chooses from, see
+// setup_rate_control()
+#define RC_NUM_LEVELS 16
+
+// Trellis quantization weighs one bit like this much squared error, in
+// squared quantization steps, see trellis_quantize_du()
+#define TRELLIS_LAMBDA 0.04f
+
+// Upper limit for jpeg_encoder_settings.num_threads
+#define ICE_MAX_THREADS 64
+
+// ICEJPEG_RESTART_AUTO aims for this many restart intervals per thread, so
+// threads that finish early can't leave too much work to the others
+#define RST_SEGMENTS_PER_THREAD 4
+
 const byte jpeg_qtbl_luminance[] = {
 	16, 11, 10, 16, 124, 140, 151, 161,
 	12, 12, 14, 19, 126, 158, 160, 155,
@@ -100,42 +150,210 @@ const byte* jpeg_qtbl_selector[] = {
 	jpeg_qtbl_luminance, jpeg_qtbl_chrominance, jpeg_qtbl_chrominance
 };
 
-struct jpeg_bit_string {
-	byte length;
-	int bits;
-};
-
+// Kept at 4 bytes, the additional bits are at most 11 bits long with
+// 8-bit samples
 struct jpeg_zrlc {
 	byte info; // bit 7-4: number of zeros, bit 3-0: category
-	struct jpeg_bit_string value;
+	byte length; // number of additional bits, 0xFF for EOB
+	word bits;
+};
+
+#define SINK_FILE       0
+#define SINK_MEMORY     1
+#define SINK_BUFFER     2
+#define SINK_CALLBACK   3
+
+// Where the JPEG data goes
+struct jpeg_output_sink
+{
+    int type;
+    // SINK_FILE
+    char *filename;
+    FILE *file;
+    // SINK_MEMORY (grown by us) and SINK_BUFFER (fixed size, supplied by the caller)
+    byte **buffer;
+    byte *data;
+    int capacity;
+    int *size;
+    // SINK_CALLBACK: small writes are collected in pending until the next flush
+    icejpeg_write_callback callback;
+    void *user;
+    byte *pending;
+    int pending_size, pending_capacity;
+
+    int bytes_written;
+    int error;
+};
+
+// Entropy coded data on its way to the output sink
+struct jpeg_bit_writer
+{
+    byte *buffer;
+    int pos, size;
+    // Number of bytes already handed to the sink
+    int flushed;
+    // Bit accumulator: the lowest put_bits bits are waiting to be written
+    uint64_t put_buffer;
+    int put_bits;
+};
+
+// A transformed DU and the samples it was transformed from
+struct jpeg_block_cache_entry
+{
+    uint32_t hash;
+    // Quantization table the block was quantized with plus 1, 0 if unused
+    int table;
+    int16_t samples[64];
+    int16_t block[64];
+};
+
+// State of one thread of the encoder. When encoding serially only the first
+// worker is used.
+struct jpeg_encode_worker
+{
+    // Range of work: image rows for color conversion, MCU rows for
+    // downsampling and MCUs for transform and entropy coding
+    int first, end;
+    // Transformed DUs of one MCU
+    int16_t *mcu_blocks;
+    int prev_dc[3];
+    int *row_acc;
+    // Symbols of all MCUs in the range and their statistics
+    struct jpeg_zrlc *rlc[3];
+    int rlc_size[3];
+    int rlc_count[3];
+    int dc_code_count[3][17];
+    int ac_code_count[3][257];
+    struct jpeg_bit_writer writer;
+    // Number of bits in the writer before it was padded
+    int64_t scan_bits;
+    // Recently transformed DUs, indexed by the hash of their samples
+    struct jpeg_block_cache_entry *block_cache;
+    int block_cache_lookups, block_cache_hits;
+#ifdef _JPEG_ENCODER_STATS
+    struct
+    {
+        int min_val, max_val;
+    } color_extrema[3];
+#endif
+    int err;
+};
+
+// Single pass encoding with several threads: all threads transform MCU rows
+// into a ring of slots, the first one codes them in order
+struct jpeg_transform_pipeline
+{
+    ice_mutex lock;
+    ice_cond changed;
+    int16_t *slots;
+    int num_slots, slot_size;
+    // MCU row held by each slot, -1 if there is none (yet)
+    int *slot_row;
+    int next_row;
+    int rows_coded;
+    int abort;
+};
+
+// One scan of a progressive image and the statistics of its symbols
+struct jpeg_encode_scan
+{
+	struct jpeg_scan_info info;
+	int dc_code_count[3][17];
+	int ac_code_count[3][257];
 };
 
 struct __ice_env
 {
-	char outfile[40];
-	int *image;
+	struct jpeg_output_sink sink;
+	// The caller's image, only valid during icejpeg_encode_init()
+	const byte *input;
+	// Packed formats: bytes per pixel and positions of red and blue
+	int input_format;
+	int input_bpp, input_red, input_blue;
+	// Planar formats: Y, Cb and Cr plane, and the size of each plane
+	const byte *input_planes[3];
+	int input_plane_width[3], input_plane_height[3];
+	// The component planes were filled straight from input_planes
+	int planes_ready;
+	// Coefficient input, see icejpeg_encode_init_coefficients()
+	const struct jpeg_coefficients *input_coefs;
+	int16_t *image;
 	int width, height;
 	int num_components;
 	int max_sx, max_sy;
 	int num_mcu_x, num_mcu_y;
 	int mcu_width, mcu_height;
-    int cur_mcu_x, cur_mcu_y;
-    int block[64];
+    int blocks_per_mcu;
+    int cur_mcu_y;
 	struct jpeg_huffman_code dc_huff[3][16];
 	struct jpeg_huffman_code ac_huff[3][256];
     int dc_huff_numcodes[3];
     int ac_huff_numcodes[3];
-	byte* scan_buffer;
-	int buf_pos;
-	unsigned char bits_remaining;
-    int scan_buf_size;
     byte quality;
 	int quality_scale_factor;
+	int quant_factor[3][64];
+	int fast_divisor[3][64];
+	// Written to DQT, component i uses table min(i, num_quant_tables - 1)
+	int num_quant_tables;
+	// Blocks whose samples deviate less than this from their mean in total
+	// are flat, see transform_du()
+	int flat_limit[3];
+
+	// Speed/size trade-offs, see jpeg_encoder_settings
+	int fast_dct;
+	int chroma_filter;
+	int standard_tables;
+	// Build the Huffman tables from every sample_step-th MCU row
+	int sampled_tables;
+	int sample_step;
+	// Target file size in bytes, and the unquantized DCT output of all DUs
+	// in coding order while searching the quality for it
+	int target_size;
+	DCTELEM *dct_blocks;
+	// Rate control: bytes per frame, the quantization factors and fast DCT
+	// divisors of each level, and the bits and level of each interval
+	int frame_budget;
+	int rc_quant_factor[RC_NUM_LEVELS][3][64];
+	int rc_fast_divisor[RC_NUM_LEVELS][3][64];
+	int rc_num_intervals;
+	int *rc_interval_bits;
+	byte *rc_interval_levels;
+	// Trellis quantization was asked for, and is done in the current pass
+	int trellis;
+	int trellis_active;
+	// Progressive encoding: the scans, and the quantized DUs of the whole
+	// image in coding order
+	int progressive;
+	struct jpeg_encode_scan *scans;
+	int num_scans;
+	int16_t *coef_blocks;
     
     // Restart markers related stuff
-    byte cur_rst_marker;
     int use_rst_markers;
-    int restart_interval, rst_interval_counter;
+    int restart_interval;
+    // As requested in the settings
+    int restart_setting;
+
+    // Number of rows held in image, either the whole image or, when encoding
+    // incrementally, a ring buffer large enough for one MCU row
+    int image_rows;
+
+    struct jpeg_encode_worker *workers;
+    int num_workers;
+    // Number of workers holding symbols of the scan
+    int num_coders;
+
+    // Single pass encoding: symbols are written right away using
+    // the standard Huffman tables or tables built from sampled statistics
+    int single_pass;
+    // Symbols are only counted, not stored
+    int sampling;
+    struct jpeg_transform_pipeline pipeline;
+
+    // Incremental encoding
+    int incremental;
+    int rows_received;
+    int headers_written;
 } iceenv;
 
 
@@ -146,28 +364,21 @@ struct jpeg_encode_component
 	int stride;
 	int sx, sy;
 	byte qt_table;
-	int *pixels;
-	int prev_dc;
-	struct jpeg_zrlc **rlc;
-    int rlc_size;
-	int rlc_index;
+	int16_t *pixels;
     int dc_code_count[17];
     int ac_code_count[257];
 	// Which code has what length?
 	byte dc_code_lengths[17];
 	byte ac_code_lengths[257];
 	// Number of codes of each length
-	byte dc_code_length_count[33];
-	byte ac_code_length_count[33];
+	byte dc_code_length_count[HUFF_MAX_CODE_LENGTH + 1];
+	byte ac_code_length_count[HUFF_MAX_CODE_LENGTH + 1];
     // sorted list of symbols to be encoded
     byte dc_huffval[16];
     byte ac_huffval[256];
     // DHT segment informatiom
     struct jpeg_dht dc_dht;
     struct jpeg_dht ac_dht;
-	long rlc_count;
-    
-    //int rlc_indices[40][40];
 };
 
 struct jpeg_encode_component icecomp[3];
@@ -176,9 +387,18 @@ struct jpeg_encode_component icecomp[3];
 struct jpeg_encoder_stats icestats;
 #endif
 
-static int write_to_file();
-
-static void print_block(int block[64])
+static int write_headers(void);
+static int write_scan_dht(const struct jpeg_scan_info *scan);
+static int write_scan_sos(const struct jpeg_scan_info *scan);
+static int use_standard_huffman_tables(void);
+static int sink_write(const void *data, int size, int count);
+static int sink_flush(void);
+static int write_trailer(void);
+static int sink_close(void);
+static inline int write_bits(struct jpeg_bit_writer *bw, uint32_t value, int length);
+inline static int write_rst_marker(struct jpeg_bit_writer *bw, int marker);
+
+static void print_block(int16_t block[64])
 {
     int x, y;
     for (y = 0; y < 8; y++)
@@ -212,1083 +432,3510 @@ inline static int get_bit_coding(int num, byte category)
 	return code;
 }
 
-static void downsample()
+// Get the int value back from its bit coding
+inline static int get_bit_value(int code, byte category)
 {
-	int i = 0;
-	int *tmpimage = 0;
-	int *outpixels = 0;
-	for (i = 0; i < iceenv.num_components; i++)
-	{
-		icecomp[i].pixels = (int*)malloc(icecomp[i].stride * iceenv.height * sizeof(int));
-
-		int x, y;
-		// Go to correct start component
-		tmpimage = iceenv.image + i;
-
-		outpixels = icecomp[i].pixels;
-
-		// Do the rows first
-		for (y = 0; y < iceenv.height; y++)
-		{
-			//outpixels = icecomp[i].pixels + (y * icecomp[i].stride);
-			int* start_index = outpixels;
-			int step_x = iceenv.max_sx / icecomp[i].sx;
-            int start_x = 0;
-            int end_x = iceenv.width;
-            int modulo = iceenv.width % step_x;
-            if (modulo)
-            {
-                start_x -= DESCALE(UPSCALE(modulo) / 2);
-                end_x -= DESCALE(UPSCALE(modulo) / 2);
-            }
-			// Have to start past the edge of the image so we don't get chroma shift!
-			for (x = start_x; x < end_x; x += step_x)
-			{
-				register int pixel_avg = 0;
-				int x2;
-				for (x2 = 0; x2 < step_x; x2++)
-				{
-					if (x + x2 < iceenv.width)
-						pixel_avg += *tmpimage;
-					else
-						pixel_avg += *(tmpimage - iceenv.num_components);
-					// Check if we're already inside the image => only then do we advance the pointer
-					// If we're not, we just replicate the edge pixel
-					if (x + x2 >= 0 && x + x2 < iceenv.width)
-						tmpimage += iceenv.num_components;
-				}
-				pixel_avg /= step_x;
-				*outpixels++ = pixel_avg;
-			}
-			int last_val = *(outpixels - 1);
-			// fill rest of the buffer with value of rightmost pixel
-			while (outpixels < start_index + icecomp[i].stride)
-            {
-				*outpixels++ = last_val;
-            }
-		}
+	if (category && code < (1 << (category - 1)))
+		return code - (1 << category) + 1;
+	return code;
+}
 
-		int *srcimage2 = icecomp[i].pixels;
-        int new_height = ((icecomp[i].sy << 3) * iceenv.num_mcu_y);
-		icecomp[i].pixels = (int*)malloc(icecomp[i].stride * new_height * sizeof(int));
+// Returns a pointer to row y of the color converted image. Rows outside of
+// the image are clamped to the top or bottom edge, which replicates the
+// border pixels. When encoding incrementally only the last image_rows rows
+// are kept in a ring buffer.
+static inline int16_t *source_row(int y)
+{
+    if (y < 0)
+        y = 0;
+    else if (y >= iceenv.height)
+        y = iceenv.height - 1;
+    return iceenv.image + ((y % iceenv.image_rows) * iceenv.width * iceenv.num_components);
+}
 
-		outpixels = icecomp[i].pixels;
-		int *cur_srcimage = 0;
+// Averages step_x horizontally adjacent samples of component comp for every
+// output column and adds the result to acc. Starting start_x samples before
+// the left edge centers the subsampled grid so we don't get chroma shift.
+static void downsample_row_h(const int16_t *src, int comp, int step_x, int start_x, int num_out, int *acc)
+{
+    const int nc = iceenv.num_components;
+    const int last = iceenv.width - 1;
+    int x = 0;
+    int ox = 0;
 
-#ifdef _JPEG_ENCODER_STATS
-		icestats.color_extrema[i].min_val = INT_MAX;
-		icestats.color_extrema[i].max_val = INT_MIN;
-#endif
-        
+    // Left edge: (some of) the samples lie in front of the image
+    for (; ox < num_out && (x = ox * step_x - start_x) < 0; ox++)
+    {
+        register int pixel_avg = 0;
+        int x2;
+        for (x2 = 0; x2 < step_x; x2++)
+            pixel_avg += src[(min(max(x + x2, 0), last) * nc) + comp];
+        acc[ox] += pixel_avg / step_x;
+    }
 
-        // ... and now the columns
-        int step_y = iceenv.max_sy / icecomp[i].sy;
-		for (x = 0; x < icecomp[i].width; x++)
-		{
-			cur_srcimage = srcimage2 + x;
-			outpixels = icecomp[i].pixels + x;
-			int* start_index = outpixels;
-            int start_y = 0;
-            int end_y = icecomp[i].height;
-            int modulo = icecomp[i].height % step_y;
-            if (modulo)
+    // Interior: all samples are inside the image, no clamping necessary
+    const int16_t *p = src + (x * nc) + comp;
+    switch (step_x)
+    {
+        case 2:
+            for (; ox < num_out && x + 1 <= last; ox++, x += 2, p += 2 * nc)
+                acc[ox] += (p[0] + p[nc]) >> 1;
+            break;
+        case 4:
+            for (; ox < num_out && x + 3 <= last; ox++, x += 4, p += 4 * nc)
+                acc[ox] += ((p[0] + p[nc]) + (p[2 * nc] + p[3 * nc])) >> 2;
+            break;
+        default:
+            for (; ox < num_out && x + step_x - 1 <= last; ox++, x += step_x, p += step_x * nc)
             {
-                start_y -= DESCALE(UPSCALE(modulo) / 2);
-                end_y -= DESCALE(UPSCALE(modulo) / 2);
+                register int pixel_avg = 0;
+                int x2;
+                for (x2 = 0; x2 < step_x; x2++)
+                    pixel_avg += p[x2 * nc];
+                acc[ox] += pixel_avg / step_x;
             }
-			// Have to start past the edge of the image so we don't get chroma shift!
-			for (y = start_y; y < end_y; y += step_y)
-			{
-				register int pixel_avg = 0;
-				int y2;
-				for (y2 = 0; y2 < step_y; y2++)
-				{
-					if (y + y2 < icecomp[i].height)
-						pixel_avg += *cur_srcimage;
-					else
-						pixel_avg += *(cur_srcimage - icecomp[i].stride);
-					// Check if we're already inside the image => only then do we advance the pointer
-					// If we're not, we just replicate the edge pixel
-					if (y + y2 >= 0 && y + y2 < icecomp[i].height)
-						cur_srcimage += icecomp[i].stride;
-				}
-				pixel_avg /= step_y;
-				// Level shift here!
-                *outpixels = pixel_avg - 128;
-#ifdef _JPEG_ENCODER_STATS
-                if (pixel_avg < icestats.color_extrema[i].min_val)
-					icestats.color_extrema[i].min_val = pixel_avg;
-                if (pixel_avg > icestats.color_extrema[i].max_val)
-					icestats.color_extrema[i].max_val = pixel_avg;
-#endif
-				outpixels += icecomp[i].stride;
-			}
-			int last_val = *(outpixels - icecomp[i].stride);
-			// fill rest of the buffer with value of bottommost pixel
-			while (outpixels < start_index + (icecomp[i].stride * (new_height - 0 /*1*/)))
-			{
-				*outpixels = last_val;
-				outpixels += icecomp[i].stride;
-			}
-		}
-        
-        icecomp[i].height = new_height;
-        
-		free(srcimage2);
-	}
-	free(iceenv.image);
-	iceenv.image = 0;
-}
-
-// The last parameter is only for the EOB code
-// Normally category == bit_length
-static int add_rlc(int comp, int zeros, int category, int bits, int bit_length)
-{
-    // Allocate memory
-    icecomp[comp].rlc[icecomp[comp].rlc_index] = (struct jpeg_zrlc*) malloc(sizeof(struct jpeg_zrlc));
-    
-    icecomp[comp].rlc[icecomp[comp].rlc_index]->info = zeros << 4;
-    
+            break;
+    }
 
-    icecomp[comp].rlc[icecomp[comp].rlc_index]->info |= category;
-    
-    icecomp[comp].rlc[icecomp[comp].rlc_index]->value.length = bit_length;
-    icecomp[comp].rlc[icecomp[comp].rlc_index]->value.bits = bits;
-    
-    icecomp[comp].rlc_index++;
-    
-    if (icecomp[comp].rlc_index == icecomp[comp].rlc_size)
+    // Right edge: replicate the rightmost pixel
+    for (; ox < num_out; ox++)
     {
-        icecomp[comp].rlc = (struct jpeg_zrlc**) realloc(icecomp[comp].rlc, (icecomp[comp].rlc_size + 0xFFFF) * sizeof(struct jpeg_zrlc*));
-		if (!icecomp[comp].rlc)
-			return ERR_OUT_OF_MEMORY;
-		memset(icecomp[comp].rlc + icecomp[comp].rlc_size, 0, 0xFFFF * sizeof(struct jpeg_zrlc*));
-        icecomp[comp].rlc_size += 0xFFFF;
+        register int pixel_avg = 0;
+        int x2;
+        x = ox * step_x - start_x;
+        for (x2 = 0; x2 < step_x; x2++)
+            pixel_avg += src[(min(x + x2, last) * nc) + comp];
+        acc[ox] += pixel_avg / step_x;
     }
- 
-    return ERR_OK;
 }
 
-//#define _JPEG_OUTPUT_DC
-
-static int encode_du(int comp, int du_x, int du_y)
+// Triangle filter: every output sample is the weighted average of the
+// 2 * step_x samples around its center, the weights being 1, 3, 5, ...
+// towards the center. The weighted sum, scaled by the sum of the weights
+// tent_weight(step_x) and by weight, is added to acc.
+static void downsample_row_tent(const int16_t *src, int comp, int step_x, int start_x, int num_out, int weight, int *acc)
 {
-    int *buffer = 0;
-    long duOriginIndex = ((iceenv.cur_mcu_y * (icecomp[comp].sy << 3) + (du_y << 3)) * icecomp[comp].stride) + (iceenv.cur_mcu_x * (icecomp[comp].sx << 3) + (du_x << 3));
-    
-// #ifdef _JPEG_ENCODER_DEBUG
-// 	if (iceenv.cur_mcu_x == 1)
-// 		printf("MCU (%d,%d), DU (%d, %d) starts at index %d\n", iceenv.cur_mcu_x, iceenv.cur_mcu_y, du_x, du_y, duOriginIndex);
-// #endif
+    const int nc = iceenv.num_components;
+    const int last = iceenv.width - 1;
+    const int taps = step_x << 1;
+    int ox, k;
 
-    // Create 8x8 block
-    int x, y;
-    for (y = 0; y < 8; y++)
+    if (step_x == 1)
     {
-        buffer = &icecomp[comp].pixels[duOriginIndex + (icecomp[comp].stride * y)];
-        memcpy(&iceenv.block[y * 8], buffer, 8 * sizeof(int));
+        for (ox = 0; ox < num_out; ox++)
+            acc[ox] += weight * src[(min(ox, last) * nc) + comp];
+        return;
     }
-    
-    // Perform DCT
-    fdct(iceenv.block);
 
-    // Quantization
-    for (y = 0; y < 8; y++)
+    for (ox = 0; ox < num_out; ox++)
     {
-        for (x = 0; x < 8; x++)
+        register int sum = 0;
+        int x = ox * step_x - start_x - (step_x >> 1);
+
+        if (x >= 0 && x + taps - 1 <= last)
+        {
+            const int16_t *p = src + (x * nc) + comp;
+            if (step_x == 2)
+                sum = p[0] + 3 * (p[nc] + p[2 * nc]) + p[3 * nc];
+            else
+            {
+                for (k = 0; k < step_x; k++)
+                    sum += ((k << 1) + 1) * (p[k * nc] + p[(taps - 1 - k) * nc]);
+            }
+        }
+        else
         {
-            register int value = iceenv.block[(y * 8) + x];
-			register int quant_factor = CLAMPQNT((iceenv.quality_scale_factor * jpeg_qtbl_selector[comp][(y * 8) + x] + 50) / 100);
-            // Right-shift rounds towards negative infinity, so we're gonna do our
-            // computations with positive numbers and then put the sign back
-            // after we're done
-            int sign = value < 0 ? -1 : 1;
-            if (sign < 0)
-                value *= sign;
-            value = UPSCALE(value);
-			value /= quant_factor;
-            iceenv.block[(y * 8) + x] = sign * DESCALE(value);
+            // Near the edges the border pixels are replicated
+            for (k = 0; k < step_x; k++)
+                sum += ((k << 1) + 1) * (src[(min(max(x + k, 0), last) * nc) + comp] +
+                                         src[(min(max(x + taps - 1 - k, 0), last) * nc) + comp]);
         }
+        acc[ox] += weight * sum;
     }
+}
 
-	// Zigzag reordering
-	int *block = (int*)malloc(64 * sizeof(int));
-	for (x = 0; x < 64; x++)
-		block[jpeg_zzleft[x]] = iceenv.block[x];
-	memcpy(iceenv.block, block, 64 * sizeof(int));
-	free(block);
-	block = 0;
-    
-#ifdef _JPEG_OUTPUT_DC
-    if (!iceenv.cur_mcu_x && !iceenv.cur_mcu_y)
-        printf("%d\n", iceenv.block[0]);
-#endif
-
-    iceenv.block[0] -= icecomp[comp].prev_dc;
-    icecomp[comp].prev_dc += iceenv.block[0];
-    //print_block(iceenv.block);
-
-	// Write DC
-	byte category = find_category(iceenv.block[0]);
-	add_rlc(comp, 0, category, get_bit_coding(iceenv.block[0], category), category);
-    
-	int* end_pointer = iceenv.block + 64;
-    // WE HAVE TO STOP ONE BEFORE THE BEGINNING OF THE BLOCK
-    // THE DC COEFFICIENT HAS TO BE WRITTEN SEPARATELY, EVEN IF THE WHOLE
-    // BLOCK IS ALL 0s
-	while (!end_pointer[-1] && end_pointer > iceenv.block+1)
-		end_pointer--;
+// Sum of the weights of the triangle filter for a given step
+static inline int tent_weight(int step)
+{
+    return step == 1 ? 1 : (step * step) << 1;
+}
 
-	// Start  with first AC component
-	block = iceenv.block + 1;
-    
-	// Do Zero Run Length Coding for this block
-	// After all MCUs have been processed, the Huffman tables will be
-	// generated based on these values
-    int start_rlc_index = icecomp[comp].rlc_index;
-	while (block < end_pointer)
+static void reset_color_extrema(struct jpeg_encode_worker *w)
+{
+#ifdef _JPEG_ENCODER_STATS
+	int i;
+	for (i = 0; i < iceenv.num_components; i++)
 	{
-		byte zeros = 0;
+		w->color_extrema[i].min_val = INT_MAX;
+		w->color_extrema[i].max_val = INT_MIN;
+	}
+#endif
+}
 
-		// count contiguous zeros, but stop at 16 because
-		// that's the most consecutive zeros than can be encoded
-		while (!(*block) && zeros < 15)
+// Combines the color extrema found by all workers
+static void merge_color_extrema(void)
+{
+#ifdef _JPEG_ENCODER_STATS
+	int i, j;
+	for (i = 0; i < iceenv.num_components; i++)
+	{
+		icestats.color_extrema[i].min_val = INT_MAX;
+		icestats.color_extrema[i].max_val = INT_MIN;
+		for (j = 0; j < iceenv.num_workers; j++)
 		{
-			zeros++;
-			block++;
+			icestats.color_extrema[i].min_val = min(icestats.color_extrema[i].min_val, iceenv.workers[j].color_extrema[i].min_val);
+			icestats.color_extrema[i].max_val = max(icestats.color_extrema[i].max_val, iceenv.workers[j].color_extrema[i].max_val);
 		}
-        register int value = *block;
-        byte category = find_category(value);
-        
-        add_rlc(comp, zeros, category, get_bit_coding(value, category), category);
-        
-		block++;
-    };
-    
-	// Only put an EOB if we don't have a zero run at the end
-	if (block < iceenv.block + 64)
+	}
+#endif
+}
+
+// Sums up the block cache counters of all workers
+static void merge_block_cache_stats(void)
+{
+#ifdef _JPEG_ENCODER_STATS
+	int i;
+	icestats.block_cache_lookups = 0;
+	icestats.block_cache_hits = 0;
+	for (i = 0; i < iceenv.num_workers; i++)
 	{
-#ifdef _JPEG_ENCODER_DEBUG
-        //printf("Block prematurely terminated after %d entries.\n", end_pointer - iceenv.block);
+		icestats.block_cache_lookups += iceenv.workers[i].block_cache_lookups;
+		icestats.block_cache_hits += iceenv.workers[i].block_cache_hits;
+	}
+	icestats.block_cache_hit_rate = icestats.block_cache_lookups ?
+		(float)icestats.block_cache_hits / (float)icestats.block_cache_lookups : 0.0f;
 #endif
-        
-        add_rlc(comp, 0, 0, 0, 0xFF);
+}
+
+// Empties the block caches, whose blocks were quantized differently
+static void reset_block_caches(void)
+{
+	int i;
+	for (i = 0; i < iceenv.num_workers; i++)
+	{
+		if (iceenv.workers[i].block_cache)
+			memset(iceenv.workers[i].block_cache, 0, BLOCK_CACHE_SIZE * sizeof(struct jpeg_block_cache_entry));
 	}
+}
 
+// Copies rows of an input plane that already has the resolution of
+// component comp, level shifting them and replicating the edges
+static void copy_input_rows(struct jpeg_encode_worker *w, int comp, int first_row, int num_rows, int16_t *dst)
+{
+	struct jpeg_encode_component *c = &icecomp[comp];
+	int plane_width = iceenv.input_plane_width[comp];
+	int plane_height = iceenv.input_plane_height[comp];
+	int x, y;
 
-#ifdef _JPEG_ENCODER_DEBUG
-//     if (icecomp[comp].rlc_index - start_rlc_index > 10)
-//         printf("MCU: (%d,%d)[%d](%d,%d): %d indices added.\n", iceenv.cur_mcu_x, iceenv.cur_mcu_y, comp, du_x, du_y, icecomp[comp].rlc_index - start_rlc_index);
-//     icecomp[comp].rlc_count += icecomp[comp].rlc_index - start_rlc_index;
+	for (y = first_row; y < first_row + num_rows; y++, dst += c->stride)
+	{
+		const byte *src = iceenv.input_planes[comp] + ((size_t)min(y, plane_height - 1) * plane_width);
+		for (x = 0; x < plane_width; x++)
+		{
+			dst[x] = src[x] - 128;
+#ifdef _JPEG_ENCODER_STATS
+			if (src[x] < w->color_extrema[comp].min_val)
+				w->color_extrema[comp].min_val = src[x];
+			if (src[x] > w->color_extrema[comp].max_val)
+				w->color_extrema[comp].max_val = src[x];
 #endif
-    
-    return ERR_OK;
+		}
+		for (; x < c->stride; x++)
+			dst[x] = dst[plane_width - 1];
+	}
 }
 
-static void get_code_stats(void)
+// Creates num_rows (level shifted) rows of component comp, starting with
+// row first_row, in a single row-major pass over the color converted image.
+// Components with maximum sampling factors are copied directly, all others
+// are box filtered.
+static void downsample_rows(struct jpeg_encode_worker *w, int comp, int first_row, int num_rows, int16_t *dst)
 {
-    int i ;
-    // Gather statistics about code occurrences
-    for (i = 0; i < iceenv.num_components; i++)
-    {
-        struct jpeg_encode_component *c = &icecomp[i];
-        int count = c->rlc_index;
-        int j;
-        int is_dc = 1;
-        int du_index = 0;
-        memset(c->dc_code_count, 0, 17 * sizeof(int));
-        memset(c->ac_code_count, 0, 257 * sizeof(int));
-        
-        for (j = 0; j < count; j++)
-        {
-            if (is_dc)
-            {
-                c->dc_code_count[c->rlc[j]->info]++;
-                is_dc = 0;
-            }
-            else
-                c->ac_code_count[c->rlc[j]->info]++;
-            
-			du_index += UPR4(c->rlc[j]->info);
-            du_index++;
-			// Reset index if we've processed all 64 samples OR encountered an EOB
-            if (du_index == 64 || c->rlc[j]->value.length == 0xFF)
-            {
-                du_index = 0;
-                is_dc = 1;
-            }
-        }
-        
-		// For Huffman code generation purposes
-		// Will be removed later on in the process
-		c->dc_code_count[16] = 1;
-		c->ac_code_count[256] = 1;
+	struct jpeg_encode_component *c = &icecomp[comp];
+	int *acc = w->row_acc;
+	int step_x = iceenv.max_sx / c->sx;
+	int step_y = iceenv.max_sy / c->sy;
+	// Number of samples actually computed in each direction, the rest of
+	// the plane is filled up with the rightmost/bottommost value
+	int num_out_x = (iceenv.width + step_x - 1) / step_x;
+	int num_out_y = (iceenv.height + step_y - 1) / step_y;
+	int start_x = DESCALE(UPSCALE(iceenv.width % step_x) / 2);
+	int start_y = DESCALE(UPSCALE(iceenv.height % step_y) / 2);
+	int x, y;
+
+	int16_t *outpixels = dst;
+
+	if (iceenv.input_planes[comp])
+	{
+		copy_input_rows(w, comp, first_row, num_rows, dst);
+		return;
+	}
 
-#ifdef _JPEG_ENCODER_DEBUG
-        
-		if (i == 0)
+	for (y = first_row; y < first_row + num_rows; y++, outpixels += c->stride)
+	{
+		if (y >= num_out_y && y > first_row)
 		{
-			printf("DC Stats comp #%d\n\n", i);
+			// fill rest of the plane with the bottommost row
+			memcpy(outpixels, outpixels - c->stride, c->stride * sizeof(int16_t));
+			continue;
+		}
 
-			for (j = 0; j < 16; j++)
+		int src_y = min(y, num_out_y - 1);
+		int y2;
+		if (step_x == 1 && step_y == 1)
+		{
+			// Full resolution: no filtering necessary
+			const int16_t *src = source_row(src_y) + comp;
+			for (x = 0; x < num_out_x; x++, src += iceenv.num_components)
+				acc[x] = *src;
+		}
+		else if (iceenv.chroma_filter == ICEJPEG_FILTER_TRIANGLE)
+		{
+			int total = tent_weight(step_x) * tent_weight(step_y);
+			memset(acc, 0, num_out_x * sizeof(int));
+			if (step_y == 1)
+				downsample_row_tent(source_row(src_y - start_y), comp, step_x, start_x, num_out_x, 1, acc);
+			else
 			{
-				if (c->dc_code_count[j] > 0)
-					printf("Code 0x%X: %d occurrences\n", j, c->dc_code_count[j]);
+				int top = src_y * step_y - start_y - (step_y >> 1);
+				for (y2 = 0; y2 < step_y; y2++)
+				{
+					downsample_row_tent(source_row(top + y2), comp, step_x, start_x, num_out_x, (y2 << 1) + 1, acc);
+					downsample_row_tent(source_row(top + (step_y << 1) - 1 - y2), comp, step_x, start_x, num_out_x, (y2 << 1) + 1, acc);
+				}
 			}
-			printf("\n");
-			printf("Final count: %ld\n\n", c->rlc_count);
+			// Normalize, the results are used like the box filter's sums below
+			for (x = 0; x < num_out_x; x++)
+				acc[x] = ((acc[x] + (total >> 1)) / total) * step_y;
 		}
+		else
+		{
+			memset(acc, 0, num_out_x * sizeof(int));
+			for (y2 = 0; y2 < step_y; y2++)
+				downsample_row_h(source_row(src_y * step_y - start_y + y2), comp, step_x, start_x, num_out_x, acc);
+		}
+
+		for (x = 0; x < num_out_x; x++)
+		{
+			register int pixel_avg = acc[x] / step_y;
+			// Level shift here!
+			outpixels[x] = pixel_avg - 128;
+#ifdef _JPEG_ENCODER_STATS
+			if (pixel_avg < w->color_extrema[comp].min_val)
+				w->color_extrema[comp].min_val = pixel_avg;
+			if (pixel_avg > w->color_extrema[comp].max_val)
+				w->color_extrema[comp].max_val = pixel_avg;
 #endif
-    }
+		}
+		// fill rest of the row with value of rightmost pixel
+		for (; x < c->stride; x++)
+			outpixels[x] = outpixels[num_out_x - 1];
+	}
 }
 
-static void find_code_lengths(void)
+// Splits the units [0, total) into contiguous ranges of roughly the same
+// size, one for each worker. Returns the number of workers that got work.
+static int split_work(int total)
 {
-    byte dc_codelengths[17];
-	byte ac_codelengths[257];
-    int dc_others[17], ac_others[257];
-    
-	// Gather statistics about code occurrences
-	get_code_stats();
+	int i;
+	int count = max(min(iceenv.num_workers, total), 1);
 
-	struct
+	for (i = 0; i < count; i++)
 	{
-		int code;
-		int freq;
-	} v[2];
+		iceenv.workers[i].first = (int)(((int64_t)total * i) / count);
+		iceenv.workers[i].end = (int)(((int64_t)total * (i + 1)) / count);
+		iceenv.workers[i].err = ERR_OK;
+	}
+	return count;
+}
 
+// Downsamples the MCU rows [first, end) of all components
+static void downsample_job(void *arg)
+{
+	struct jpeg_encode_worker *w = (struct jpeg_encode_worker*)arg;
 	int i;
 
 	for (i = 0; i < iceenv.num_components; i++)
 	{
-		int dcac = 0;
+		struct jpeg_encode_component *c = &icecomp[i];
+		int rows_per_mcu = c->sy << 3;
+		downsample_rows(w, i, w->first * rows_per_mcu, (w->end - w->first) * rows_per_mcu,
+						c->pixels + (w->first * rows_per_mcu * c->stride));
+	}
+}
 
-		// pointers to current array
-		byte *codelengths = 0;
-		int *others = 0;
-		int *codecount = 0;
-		// Do DC and AC
-		for (dcac = 0; dcac < 2; dcac++)
-		{
-			struct jpeg_encode_component *c = &icecomp[i];
+// Creates the complete sample planes of all components from the color
+// converted image, which isn't needed anymore afterwards
+static int downsample()
+{
+	int i = 0;
 
-			codelengths = !dcac ? dc_codelengths : ac_codelengths;
-			others = !dcac ? dc_others : ac_others;
-			codecount = !dcac ? c->dc_code_count : c->ac_code_count;
-			int numcodes = !dcac ? 17 : 257;
+	if (iceenv.planes_ready)
+		return ERR_OK;
 
-			memset(codelengths, 0, numcodes);
-			memset(others, -1, sizeof(int) * numcodes);
+	for (i = 0; i < iceenv.num_components; i++)
+	{
+		struct jpeg_encode_component *c = &icecomp[i];
+        int new_height = ((c->sy << 3) * iceenv.num_mcu_y);
 
-			// Proceed according to JPEG Standard Annex K, Figure K.1
-			do
-			{
-				int  j;
-				// Find least FREQ(V1) and FREQ(V2)
-				for (j = 0; j < 2; j++)
-				{
-					// Find rarest code in DC frequency count table
-					v[j].code = -1;
-					v[j].freq = INT_MAX;
+		c->pixels = (int16_t*)malloc(c->stride * new_height * sizeof(int16_t));
+		if (!c->pixels)
+			return ERR_OUT_OF_MEMORY;
+        c->height = new_height;
+	}
 
-					int code_index = 0;
-					for (code_index = 0; code_index < numcodes; code_index++)
-					{
-						if (j == 1 && code_index == v[0].code)
-							continue;
-						if (codecount[code_index] && codecount[code_index] <= v[j].freq && code_index > v[j].code)
-						{
-							v[j].code = code_index;
-							v[j].freq = codecount[code_index];
-						}
-					}
-				}
+	for (i = 0; i < iceenv.num_workers; i++)
+		reset_color_extrema(&iceenv.workers[i]);
+	ice_run_parallel(downsample_job, iceenv.workers, sizeof(struct jpeg_encode_worker), split_work(iceenv.num_mcu_y));
+	merge_color_extrema();
 
-				// No V2? Break
-				if (v[1].freq == INT_MAX)
-					break;
-
-				codecount[v[0].code] += codecount[v[1].code];
-				codecount[v[1].code] = 0;
-
-				while (1)
-				{
-					codelengths[v[0].code] += 1;
+	free(iceenv.image);
+	iceenv.image = 0;
 
-					if (others[v[0].code] == -1)
-						break;
+	return ERR_OK;
+}
 
-					v[0].code = others[v[0].code];
-				}
+// The last parameter is only for the EOB code
+// Normally category == bit_length
+static int add_rlc(struct jpeg_encode_worker *w, int comp, int is_dc, int zeros, int category, int bits, int bit_length)
+{
+    if (iceenv.sampling)
+    {
+        if (is_dc)
+            w->dc_code_count[comp][(zeros << 4) | category]++;
+        else
+            w->ac_code_count[comp][(zeros << 4) | category]++;
+        return ERR_OK;
+    }
 
-				others[v[0].code] = v[1].code;
+    if (w->rlc_count[comp] == w->rlc_size[comp])
+    {
+        int new_size = max(w->rlc_size[comp] * 2, 0xFFFF);
+        struct jpeg_zrlc *new_rlc = (struct jpeg_zrlc*) realloc(w->rlc[comp], new_size * sizeof(struct jpeg_zrlc));
+		if (!new_rlc)
+			return ERR_OUT_OF_MEMORY;
+        w->rlc[comp] = new_rlc;
+        w->rlc_size[comp] = new_size;
+    }
 
-				while (1)
-				{
-					codelengths[v[1].code] += 1;
+    struct jpeg_zrlc *rlc = &w->rlc[comp][w->rlc_count[comp]++];
+    rlc->info = (zeros << 4) | category;
+    rlc->length = bit_length;
+    rlc->bits = bits;
 
-					if (others[v[1].code] == -1)
-						break;
+    // Gather statistics about code occurrences
+    if (is_dc)
+        w->dc_code_count[comp][rlc->info]++;
+    else
+        w->ac_code_count[comp][rlc->info]++;
+ 
+    return ERR_OK;
+}
 
-					v[1].code = others[v[1].code];
-				}
-			} while (others[v[1].code] == -1);
+// Hands a symbol to the entropy coder. In two-pass mode the symbols are
+// collected for Huffman table generation, otherwise they are written
+// to the bit stream right away.
+static inline int emit_symbol(struct jpeg_encode_worker *w, int comp, int is_dc, int zeros, int category, int bits, int bit_length)
+{
+    if (!iceenv.single_pass)
+        return add_rlc(w, comp, is_dc, zeros, category, bits, bit_length);
 
-			// AT THIS POINT WE HAVE THE CODE LENGTH FOR EACH SYMBOL STORED IN codelengths
+    struct jpeg_huffman_code *code;
+    if (is_dc)
+    {
+        // DC symbols are the category alone, the DC tables have 16 entries
+        if (category > 15)
+            return ERR_NO_HUFFMAN_CODE_FOR_SYMBOL;
+        code = &iceenv.dc_huff[comp][category];
+    }
+    else
+        code = &iceenv.ac_huff[comp][(byte)((zeros << 4) | category)];
+    if (!code->length)
+        return ERR_NO_HUFFMAN_CODE_FOR_SYMBOL;
 
-			memcpy(!dcac ? c->dc_code_lengths : c->ac_code_lengths, codelengths, numcodes);
+    if (bit_length == 0xFF)
+        return write_bits(&w->writer, code->code, code->length);
+    return write_bits(&w->writer, ((uint32_t)code->code << bit_length) | (uint32_t)bits, code->length + bit_length);
+}
 
-			// NOW WE COUNT THE NUMBER OF CODES OF EACH LENGTH
-			// WE CAN POTENTIALLY HAVE CODES OF UP TO 32 BITS AT THIS POINT
-			byte num_codes_of_each_length[33];
-			memset(num_codes_of_each_length, 0, sizeof(num_codes_of_each_length));
-			int j = 0;
-			for (j = 0; j < numcodes; j++)
-			{
-				if (codelengths[j])
-					num_codes_of_each_length[codelengths[j]]++;
-			}
+// Quantizes an output value of fdct()
+static inline int quantize(int value, int quant_factor)
+{
+    // Right-shift rounds towards negative infinity, so we're gonna do our
+    // computations with positive numbers and then put the sign back
+    // after we're done
+    int sign = value < 0 ? -1 : 1;
+    if (sign < 0)
+        value *= sign;
+    value = UPSCALE(value);
+    value /= quant_factor;
+    return sign * DESCALE(value);
+}
 
-			memcpy(!dcac ? c->dc_code_length_count : c->ac_code_length_count, num_codes_of_each_length, sizeof(num_codes_of_each_length));
+// Quantizes an output value of fdct_fast(). The DCT scale factors are part
+// of the divisor, round to nearest.
+static inline int quantize_fast(int value, int divisor)
+{
+    if (value < 0)
+        return -((-value + (divisor >> 1)) / divisor);
+    return (value + (divisor >> 1)) / divisor;
+}
 
-#ifdef _JPEG_ENCODER_DEBUG
+// Rate-distortion optimized quantization and zigzag reordering of the DCT
+// output of a single DU against the current Huffman tables. Each AC
+// coefficient keeps its rounded value, is lowered by 1 in magnitude or
+// becomes 0, whichever combination has the lowest squared error plus
+// TRELLIS_LAMBDA times its bits. The error is measured in quantization
+// steps, so the quantization table weighs it the way it does visually.
+// The best combination is found by dynamic programming over the
+// coefficients that don't round to 0. Symbols without a code are never
+// chosen, plain rounding is always possible.
+static void trellis_quantize_du(int comp, const DCTELEM *data, int16_t *block)
+{
+    const struct jpeg_huffman_code *ac = iceenv.ac_huff[comp];
+    // Unquantized coefficients in zigzag order, in quantization steps
+    float value[64];
+    // Error of setting the coefficients 1 to k to 0
+    float zero_error[64];
+    // Nodes of the trellis: the start in front of the first AC coefficient,
+    // then each candidate value of each coefficient that doesn't round to 0
+    int pos[128], prev[128];
+    int16_t candidate[128];
+    float cost[128];
+    int num_nodes = 1, first_at_pos, best;
+    float best_cost;
+    int x, k, n;
+
+    for (x = 0; x < 64; x++)
+    {
+        k = jpeg_zzleft[x];
+        if (iceenv.fast_dct)
+        {
+            value[k] = (float)data[x] / (float)iceenv.fast_divisor[comp][x];
+            block[k] = quantize_fast(data[x], iceenv.fast_divisor[comp][x]);
+        }
+        else
+        {
+            value[k] = (float)data[x] / (float)iceenv.quant_factor[comp][x];
+            block[k] = quantize(data[x], iceenv.quant_factor[comp][x]);
+        }
+    }
 
-// 			if (i == 0 && dcac == 0)
-// 			{
-//            printf("Component %d, dcac=%d\n", i, dcac);
-// 
-// 				for (j = 0; j < numcodes; j++)
-// 				{
-// 					printf("Code size of symbol %X = %d\n", j, !dcac ? c->dc_code_lengths[j] : c->ac_code_lengths[j]);
-// 				}
-// 				printf("\n");
-// 				for (j = 0; j < 33; j++)
-// 				{
-// 					printf("Number of codes of length %d : %d\n", j, num_codes_of_each_length[j]);
-// 				}
+    zero_error[0] = 0.0f;
+    for (k = 1; k < 64; k++)
+        zero_error[k] = zero_error[k - 1] + (value[k] * value[k]);
 
-//			}
-#endif
-		}
-	}
-}
+    pos[0] = 0;
+    prev[0] = -1;
+    candidate[0] = 0;
+    cost[0] = 0.0f;
 
-static void limit_code_lengths()
-{
-	int ncomp = 0;
-	for (ncomp = 0; ncomp < iceenv.num_components; ncomp++)
-	{
-		struct jpeg_encode_component *c = &icecomp[ncomp];
-		byte *code_length_count = 0;
-		int dcac = 0;
-		for (dcac = 0; dcac < 2; dcac++)
-		{
-			code_length_count = !dcac ? c->dc_code_length_count : c->ac_code_length_count;
+    for (k = 1; k < 64; k++)
+    {
+        int rounded = block[k];
+        int num_candidates = abs(rounded) > 1 ? 2 : 1;
+        int i;
 
-			int i = 32, j;
-			
-			while (1)
-			{
-				if (!code_length_count[i])
-				{
-					i--;
-					if (i == 16)
-					{
-						// Below 16 we work our way down until we find a code length that is used
-						while (!code_length_count[i])
-							i--;
+        if (!rounded)
+            continue;
 
-						// This will be the maximum code length in use
-						// One must be subtracted from it because the "fake" code
-						// added during
-						// c->dc_code_count[16] = 1;
-						// c->ac_code_count[256] = 1;
-						// must be removed from the count
-						code_length_count[i]--;
+        first_at_pos = num_nodes;
+        for (i = 0; i < num_candidates; i++)
+        {
+            int c = i ? rounded - (rounded < 0 ? -1 : 1) : rounded;
+            int category = find_category(c);
+            float error = (value[k] - c) * (value[k] - c);
 
-						break;
-					}
-					else
-					{
-						continue;
-					}
-				}
+            best = -1;
+            best_cost = 0.0f;
+            for (n = 0; n < first_at_pos; n++)
+            {
+                int run = k - pos[n] - 1;
+                int length = ac[((run & 15) << 4) | category].length;
+                int bits;
+                float node_cost;
+
+                if (!length || (run > 15 && !ac[0xF0].length))
+                    continue;
+                bits = ((run >> 4) * ac[0xF0].length) + length + category;
+                node_cost = cost[n] + (zero_error[k - 1] - zero_error[pos[n]]) + error + (TRELLIS_LAMBDA * bits);
+                if (best < 0 || node_cost < best_cost)
+                {
+                    best = n;
+                    best_cost = node_cost;
+                }
+            }
 
-				j = i - 1;
-				j--;
-				while (!code_length_count[j])
-					j--;
+            if (best < 0)
+                continue;
+            pos[num_nodes] = k;
+            prev[num_nodes] = best;
+            candidate[num_nodes] = (int16_t)c;
+            cost[num_nodes] = best_cost;
+            num_nodes++;
+        }
+    }
 
-				code_length_count[i] -= 2;
-				code_length_count[i - 1]++;
-				code_length_count[j + 1] += 2;
-				code_length_count[j]--;
-			}
+    // The last nonzero coefficient, followed by EOB unless it is the 63rd
+    best = -1;
+    best_cost = 0.0f;
+    for (n = 0; n < num_nodes; n++)
+    {
+        float node_cost = cost[n] + (zero_error[63] - zero_error[pos[n]]);
+        if (pos[n] < 63)
+        {
+            if (!ac[0x00].length)
+                continue;
+            node_cost += TRELLIS_LAMBDA * ac[0x00].length;
+        }
+        if (best < 0 || node_cost < best_cost)
+        {
+            best = n;
+            best_cost = node_cost;
+        }
+    }
 
-#ifdef _JPEG_ENCODER_DEBUG
-//			if (ncomp == 0 && dcac == 0)
-//			{
-//				int dbg = 0;
-//				for (dbg = 0; dbg < 32; dbg++)
-//				{
-//					printf("Number of codes of length %d : %d\n", dbg, code_length_count[dbg]);
-//				}
-//			}
-#endif
-		}
-	}
+    // Plain rounding is kept if no path was found
+    if (best < 0)
+        return;
+    memset(block + 1, 0, 63 * sizeof(int16_t));
+    for (n = best; n > 0; n = prev[n])
+        block[pos[n]] = candidate[n];
 }
 
-// static void sort_codes()
-//
-// Here we generate a sorted list of symbols
-// sort criterion is the symbol's VLC code length
-static void sort_codes()
+// Quantization and zigzag reordering of the DCT output of a single DU
+static void quantize_du(int comp, const DCTELEM *data, int16_t *block)
 {
-	byte dc_huffval[16];
-	byte ac_huffval[256];
-
-	int ncomp = 0;
-	for (ncomp = 0; ncomp < iceenv.num_components; ncomp++)
-	{
-		struct jpeg_encode_component *c = &icecomp[ncomp];
-		byte *codelengths = 0;
-		byte *huffval = 0;
-		int dcac = 0;
-		int numcodes = 0;
-		for (dcac = 0; dcac < 2; dcac++)
-		{
-			codelengths = !dcac ? c->dc_code_lengths : c->ac_code_lengths;
-			huffval = !dcac ? dc_huffval : ac_huffval;
-			numcodes = !dcac ? 16 : 256;
+    int x;
 
-			memset(huffval, 0, sizeof(byte) * numcodes);
-
-			int i = 1, j, k = 0;
+    if (iceenv.trellis_active)
+    {
+        trellis_quantize_du(comp, data, block);
+        return;
+    }
 
-			while (i < 33)
-			{
-				j = 0;
-				while (j < numcodes)
-				{
-					if (codelengths[j] == i)
-						huffval[k++] = j;
+    if (iceenv.fast_dct)
+    {
+        const int *divisor = iceenv.fast_divisor[comp];
+        for (x = 0; x < 64; x++)
+            block[jpeg_zzleft[x]] = quantize_fast(data[x], divisor[x]);
+    }
+    else
+    {
+        for (x = 0; x < 64; x++)
+            block[jpeg_zzleft[x]] = quantize(data[x], iceenv.quant_factor[comp][x]);
+    }
+}
 
-					j++;
-				}
-				i++;
-			}
-			
-            memcpy(!dcac ? c->dc_huffval : c->ac_huffval, huffval, sizeof(byte) * numcodes);
-            
-#ifdef _JPEG_ENCODER_DEBUG
-//			if (ncomp == 0 && dcac == 0)
-//			{
+// Quantizes the DCT output of a single DU with the factors of a rate
+// control level. The coefficients are given in steps of the frame's
+// quantization table, which is the only one the decoder knows about.
+static void quantize_du_level(int comp, const DCTELEM *data, int16_t *block, int level)
+{
+    const int *frame_factor = iceenv.quant_factor[comp];
+    const int *factor = iceenv.rc_quant_factor[level][comp];
+    int x, value;
 
-				for (j = 0; j < numcodes; j++)
-				{
-					printf("Position %d -> Code %d\n", j, huffval[j]);
-				}
-				printf("\n");
-//			}
-#endif
+    if (!level)
+    {
+        quantize_du(comp, data, block);
+        return;
+    }
 
-		}
-	}
+    for (x = 0; x < 64; x++)
+    {
+        if (iceenv.fast_dct)
+            value = quantize_fast(data[x], iceenv.rc_fast_divisor[level][comp][x]);
+        else
+            value = quantize(data[x], factor[x]);
+        block[jpeg_zzleft[x]] = quantize_fast(value * factor[x], frame_factor[x]);
+    }
 }
 
-// Here we create the JPEG style DHT data
-// which can be used by the function get_huffman_tables() from the
-// decoder to generate out bitstrings
-static void gen_DHT(void)
+// Performs DCT, quantization and zigzag reordering of a single DU.
+// origin points to the top left sample of the DU within its plane.
+static void transform_du(struct jpeg_encode_worker *w, int comp, const int16_t *origin, int stride, int16_t *block)
 {
-    int ncomp = 0;
-    for (ncomp = 0; ncomp < iceenv.num_components; ncomp++)
+    // The DCT needs 32 bits for its intermediate results
+    DCTELEM data[64];
+    int16_t samples[64];
+    struct jpeg_block_cache_entry *entry = 0;
+    uint32_t hash = 0;
+    int x, y;
+    int sum = 0;
+    int mean, deviation;
+
+    // Create 8x8 block
+    for (y = 0; y < 8; y++, origin += stride)
     {
-        struct jpeg_encode_component *c = &icecomp[ncomp];
-        int dcac = 0;
-        int numcodes = 0;
-        struct jpeg_dht *dht = 0;
-        byte *codelength_count = 0;
-        for (dcac = 0; dcac < 2; dcac++)
+        for (x = 0; x < 8; x++)
         {
-            dht = !dcac ? &c->dc_dht : &c->ac_dht;
-            codelength_count = !dcac ? c->dc_code_length_count : c->ac_code_length_count;
-            numcodes = !dcac ? 16 : 256;
-            
-            byte codes_total = 0;
-            int i = 0;
-            for (i = 0; i < 16; i++)
-            {
-                dht->num_codes[i] = codelength_count[i+1];
-                codes_total += dht->num_codes[i];
-            }
-            
-            dht->codes = (byte*) malloc(codes_total);
-            memcpy(dht->codes, !dcac ? c->dc_huffval : c->ac_huffval, codes_total);
-            
-            if (!dcac)
-               iceenv.dc_huff_numcodes[ncomp] = codes_total;
-            else
-               iceenv.ac_huff_numcodes[ncomp] = codes_total;
+            data[(y * 8) + x] = samples[(y * 8) + x] = origin[x];
+            sum += origin[x];
+        }
+    }
+
+    // Flat blocks: no AC coefficient exceeds a quarter of the summed
+    // absolute deviation from the mean, so if that is small enough all of
+    // them quantize to 0 and only the DC coefficient needs to be computed.
+    // It is the sum of the samples for the fast DCT and an eighth of it
+    // for the accurate one.
+    mean = (sum + 32) >> 6;
+    deviation = 0;
+    for (x = 0; x < 64 && deviation < iceenv.flat_limit[comp]; x++)
+        deviation += abs(data[x] - mean);
+    if (deviation < iceenv.flat_limit[comp])
+    {
+        memset(block, 0, 64 * sizeof(int16_t));
+        if (iceenv.fast_dct)
+            block[0] = quantize_fast(sum, iceenv.fast_divisor[comp][0]);
+        else
+            block[0] = quantize(sum >> 3, iceenv.quant_factor[comp][0]);
+        return;
+    }
 
+    // Identical blocks, e.g. in screen content, are only transformed once
+    // as long as they stay in the cache. The chroma components share their
+    // quantization table.
+    if (w->block_cache)
+    {
+        int table = (comp ? 1 : 0) + 1;
+        uint64_t words[16], h = 0;
+        memcpy(words, samples, sizeof(samples));
+        for (x = 0; x < 16; x++)
+            h = (h ^ words[x]) * 0x9E3779B97F4A7C15ull;
+        hash = (uint32_t)(h >> 32);
+
+        entry = &w->block_cache[hash & (BLOCK_CACHE_SIZE - 1)];
+        w->block_cache_lookups++;
+        if (entry->table == table && entry->hash == hash && !memcmp(entry->samples, samples, sizeof(samples)))
+        {
+            w->block_cache_hits++;
+            memcpy(block, entry->block, 64 * sizeof(int16_t));
+            return;
         }
+        entry->table = table;
+        entry->hash = hash;
+        memcpy(entry->samples, samples, sizeof(samples));
     }
+
+    // Perform DCT
+    if (iceenv.fast_dct)
+        fdct_fast(data);
+    else
+        fdct(data);
+    quantize_du(comp, data, block);
+
+    if (entry)
+        memcpy(entry->block, block, 64 * sizeof(int16_t));
 }
 
-// Here we finally create the 2 global DC Huffman tables and 2 AC Huffman tables
-// which can be used for encoding
-static int gen_huffman_tables(void)
+// Does DC prediction and codes the DC coefficient of a block
+static inline int code_du_dc(struct jpeg_encode_worker *w, int comp, const int16_t *block)
 {
-	int i, j, k;
+    int dc_diff = block[0] - w->prev_dc[comp];
+    w->prev_dc[comp] = block[0];
+
+	byte category = find_category(dc_diff);
+	return emit_symbol(w, comp, 1, 0, category, get_bit_coding(dc_diff, category), category);
+}
+
+// Does DC prediction and zero run length coding of a quantized,
+// zigzag ordered block
+static int code_du(struct jpeg_encode_worker *w, int comp, const int16_t *block)
+{
+    int err;
+
+	// Write DC
+	err = code_du_dc(w, comp, block);
+	if (err)
+		return err;
+    
+	const int16_t *end_pointer = block + 64;
+    // WE HAVE TO STOP ONE BEFORE THE BEGINNING OF THE BLOCK
+    // THE DC COEFFICIENT HAS TO BE WRITTEN SEPARATELY, EVEN IF THE WHOLE
+    // BLOCK IS ALL 0s
+	while (!end_pointer[-1] && end_pointer > block+1)
+		end_pointer--;
+
+	// Start  with first AC component
+	const int16_t *cur = block + 1;
+    
+	// Do Zero Run Length Coding for this block
+	// After all MCUs have been processed, the Huffman tables will be
+	// generated based on these values
+	while (cur < end_pointer)
+	{
+		byte zeros = 0;
+
+		// count contiguous zeros, but stop at 16 because
+		// that's the most consecutive zeros than can be encoded
+		while (!(*cur) && zeros < 15)
+		{
+			zeros++;
+			cur++;
+		}
+        register int value = *cur;
+        byte category = find_category(value);
+        
+        err = emit_symbol(w, comp, 0, zeros, category, get_bit_coding(value, category), category);
+		if (err)
+			return err;
+        
+		cur++;
+    };
+    
+	// Only put an EOB if we don't have a zero run at the end
+	if (cur < block + 64)
+		return emit_symbol(w, comp, 0, 0, 0, 0, 0xFF);
+
+    return ERR_OK;
+}
+
+// Is MCU number mcu the last one of a restart interval that is followed
+// by a restart marker?
+static inline int ends_interval(int mcu)
+{
+    return iceenv.use_rst_markers && mcu + 1 < iceenv.num_mcu_x * iceenv.num_mcu_y &&
+           !((mcu + 1) % iceenv.restart_interval);
+}
+
+// Number of the restart marker following MCU number mcu
+static inline int rst_marker_after(int mcu)
+{
+    return ((mcu + 1) / iceenv.restart_interval - 1) & 7;
+}
+
+// Quantizes the DUs of MCU number mcu from their DCT output kept in
+// dct_blocks, see choose_quality(). level is the rate control level,
+// 0 quantizes with the frame's tables.
+static void quantize_mcu(int mcu, int16_t *blocks, int level)
+{
+    const DCTELEM *data = iceenv.dct_blocks + ((size_t)mcu * iceenv.blocks_per_mcu * 64);
+    int i, j;
+
+    for (i = 0; i < iceenv.num_components; i++)
+    {
+        for (j = icecomp[i].sx * icecomp[i].sy; j > 0; j--, data += 64, blocks += 64)
+            quantize_du_level(i, data, blocks, level);
+    }
+}
+
+// Copies the DUs of MCU number mcu from the caller's coefficient planes
+// into blocks, in zigzag order
+static void copy_input_mcu(int mcu, int16_t *blocks)
+{
+    int mcu_x = mcu % iceenv.num_mcu_x;
+    int mcu_y = mcu / iceenv.num_mcu_x;
+    int i, sx, sy, x;
+
+    for (i = 0; i < iceenv.num_components; i++)
+    {
+        const struct jpeg_coefficient_plane *plane = &iceenv.input_coefs->planes[i];
+        for (sy = 0; sy < icecomp[i].sy; sy++)
+        {
+            for (sx = 0; sx < icecomp[i].sx; sx++, blocks += 64)
+            {
+                const short *src = plane->coefs + (((size_t)(mcu_y * icecomp[i].sy + sy) * plane->blocks_x) + (mcu_x * icecomp[i].sx + sx)) * 64;
+                for (x = 0; x < 64; x++)
+                    blocks[jpeg_zzleft[x]] = src[x];
+            }
+        }
+    }
+}
+
+// Transforms the DUs of MCU number mcu into blocks, one after the other in
+// the order they are coded. MCU row first_plane_row is the topmost one held
+// in the component planes.
+static void transform_mcu(struct jpeg_encode_worker *w, int mcu, int first_plane_row, int16_t *blocks)
+{
+    int mcu_x = mcu % iceenv.num_mcu_x;
+    int plane_row = mcu / iceenv.num_mcu_x - first_plane_row;
+    int i, sx, sy;
+
+    if (iceenv.dct_blocks)
+    {
+        quantize_mcu(mcu, blocks, 0);
+        return;
+    }
+    if (iceenv.input_coefs)
+    {
+        copy_input_mcu(mcu, blocks);
+        return;
+    }
+
+    for (i = 0; i < iceenv.num_components; i++)
+    {
+        struct jpeg_encode_component *c = &icecomp[i];
+        for (sy = 0; sy < c->sy; sy++)
+        {
+            for (sx = 0; sx < c->sx; sx++, blocks += 64)
+            {
+                const int16_t *origin = c->pixels + ((plane_row * (c->sy << 3) + (sy << 3)) * c->stride) + (mcu_x * (c->sx << 3) + (sx << 3));
+                transform_du(w, i, origin, c->stride, blocks);
+            }
+        }
+    }
+}
+
+// Codes the transformed DUs of MCU number mcu
+static int code_mcu(struct jpeg_encode_worker *w, int mcu, const int16_t *blocks)
+{
+    int i, j, err;
+
+    for (i = 0; i < iceenv.num_components; i++)
+    {
+        for (j = icecomp[i].sx * icecomp[i].sy; j > 0; j--, blocks += 64)
+        {
+            err = code_du(w, i, blocks);
+            if (err)
+                return err;
+        }
+    }
+
+    // If a restart marker must be written, reset DC prediction as well
+    if (ends_interval(mcu))
+    {
+        for (i = 0; i < iceenv.num_components; i++)
+            w->prev_dc[i] = 0;
+        if (iceenv.single_pass && write_rst_marker(&w->writer, rst_marker_after(mcu)))
+            return ERR_OUT_OF_MEMORY;
+    }
+
+    return ERR_OK;
+}
+
+// Encodes the MCUs [first_mcu, end_mcu), counted in raster order. MCU row
+// first_plane_row is the topmost one held in the component planes.
+// Unless the range continues the one encoded before by the same worker, it
+// has to start at the beginning of a restart interval.
+static int encode_mcus(struct jpeg_encode_worker *w, int first_mcu, int end_mcu, int first_plane_row)
+{
+    int mcu, i, err;
+
+    if (!first_mcu || (iceenv.use_rst_markers && !(first_mcu % iceenv.restart_interval)))
+    {
+        for (i = 0; i < iceenv.num_components; i++)
+            w->prev_dc[i] = 0;
+    }
+
+    for (mcu = first_mcu; mcu < end_mcu; mcu++)
+    {
+        transform_mcu(w, mcu, first_plane_row, w->mcu_blocks);
+        err = code_mcu(w, mcu, w->mcu_blocks);
+        if (err)
+            return err;
+    }
+
+    return ERR_OK;
+}
+
+// Adds up the symbol statistics of all workers
+static void get_code_stats(void)
+{
+    int i, j, k;
+    for (i = 0; i < iceenv.num_components; i++)
+    {
+        struct jpeg_encode_component *c = &icecomp[i];
+        memset(c->dc_code_count, 0, 17 * sizeof(int));
+        memset(c->ac_code_count, 0, 257 * sizeof(int));
+
+        for (k = 0; k < iceenv.num_coders; k++)
+        {
+            struct jpeg_encode_worker *w = &iceenv.workers[k];
+            for (j = 0; j < 16; j++)
+                c->dc_code_count[j] += w->dc_code_count[i][j];
+            for (j = 0; j < 256; j++)
+                c->ac_code_count[j] += w->ac_code_count[i][j];
+        }
+        
+		// Tables built from sampled statistics need a code for every symbol
+		// that may occur in the rest of the image: DC categories 0-11, as DC
+		// prediction was restarted in every sampled row, and unless all rows
+		// were sampled EOB, ZRL and all runs with AC categories 1-10
+		if (iceenv.sampled_tables)
+		{
+			for (j = 0; j < 12; j++)
+				c->dc_code_count[j]++;
+		}
+		if (iceenv.sampled_tables && iceenv.sample_step > 1)
+		{
+			c->ac_code_count[0x00]++;
+			c->ac_code_count[0xF0]++;
+			for (j = 0; j < 16; j++)
+			{
+				for (k = 1; k <= 10; k++)
+					c->ac_code_count[(j << 4) | k]++;
+			}
+		}
+
+		// For Huffman code generation purposes
+		// Will be removed later on in the process
+		c->dc_code_count[16] = 1;
+		c->ac_code_count[256] = 1;
+
+#ifdef _JPEG_ENCODER_DEBUG
+        
+		if (i == 0)
+		{
+			printf("DC Stats comp #%d\n\n", i);
+
+			for (j = 0; j < 16; j++)
+			{
+				if (c->dc_code_count[j] > 0)
+					printf("Code 0x%X: %d occurrences\n", j, c->dc_code_count[j]);
+			}
+			printf("\n");
+		}
+#endif
+    }
+}
+
+// A Huffman tree of n symbols has n - 1 inner nodes
+#define HUFF_MAX_NODES (2 * 257)
+
+// Order of the nodes in the heap used by build_code_lengths(): the least
+// frequent node comes first and among equally frequent nodes the one with the
+// higher symbol value. This is the order in which the search of Figure K.1
+// in Annex K picks them, so the resulting code lengths are the same.
+static inline int huff_node_before(const int *freq, const int *symbol, int a, int b)
+{
+	if (freq[a] != freq[b])
+		return freq[a] < freq[b];
+	return symbol[a] > symbol[b];
+}
+
+static void huff_heap_push(int *heap, int *size, const int *freq, const int *symbol, int node)
+{
+	int i = (*size)++;
+	while (i > 0)
+	{
+		int parent = (i - 1) >> 1;
+		if (!huff_node_before(freq, symbol, node, heap[parent]))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = node;
+}
+
+static int huff_heap_pop(int *heap, int *size, const int *freq, const int *symbol)
+{
+	int top = heap[0];
+	int node = heap[--(*size)];
+	int i = 0;
+	while (1)
+	{
+		int child = (i << 1) + 1;
+		if (child >= *size)
+			break;
+		if (child + 1 < *size && huff_node_before(freq, symbol, heap[child + 1], heap[child]))
+			child++;
+		if (!huff_node_before(freq, symbol, heap[child], node))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = node;
+	return top;
+}
+
+// Builds the Huffman tree of the numcodes symbols with the given frequencies
+// and stores the depth of each symbol in codelengths. Symbols that don't
+// occur get a length of 0.
+static void build_code_lengths(const int *codecount, int numcodes, byte *codelengths)
+{
+	int freq[HUFF_MAX_NODES];
+	// Inner nodes are represented by the symbol of their less frequent child
+	int symbol[HUFF_MAX_NODES];
+	int parent[HUFF_MAX_NODES];
+	int depth[HUFF_MAX_NODES];
+	int heap[257];
+	int heap_size = 0;
+	int num_nodes = numcodes;
+	int i;
+
+	memset(codelengths, 0, numcodes);
+
+	for (i = 0; i < numcodes; i++)
+	{
+		if (!codecount[i])
+			continue;
+		freq[i] = codecount[i];
+		symbol[i] = i;
+		huff_heap_push(heap, &heap_size, freq, symbol, i);
+	}
+
+	// Merge the two least frequent nodes until only the root is left
+	while (heap_size > 1)
+	{
+		int v1 = huff_heap_pop(heap, &heap_size, freq, symbol);
+		int v2 = huff_heap_pop(heap, &heap_size, freq, symbol);
+
+		freq[num_nodes] = freq[v1] + freq[v2];
+		symbol[num_nodes] = symbol[v1];
+		parent[v1] = parent[v2] = num_nodes;
+		huff_heap_push(heap, &heap_size, freq, symbol, num_nodes);
+		num_nodes++;
+	}
+
+	if (num_nodes == numcodes)
+		return;
+
+	// Parents are always created after their children, so the depths can be
+	// computed going backwards from the root
+	depth[num_nodes - 1] = 0;
+	for (i = num_nodes - 2; i >= numcodes; i--)
+		depth[i] = depth[parent[i]] + 1;
+
+	for (i = 0; i < numcodes; i++)
+	{
+		if (codecount[i])
+			codelengths[i] = depth[parent[i]] + 1;
+	}
+}
+
+static void find_code_lengths(void)
+{
+	// Gather statistics about code occurrences
+	get_code_stats();
+
+	int i;
+
+	for (i = 0; i < iceenv.num_components; i++)
+	{
+		struct jpeg_encode_component *c = &icecomp[i];
+		int dcac = 0;
+
+		// Do DC and AC
+		for (dcac = 0; dcac < 2; dcac++)
+		{
+			byte *codelengths = !dcac ? c->dc_code_lengths : c->ac_code_lengths;
+			int numcodes = !dcac ? 17 : 257;
+
+			build_code_lengths(!dcac ? c->dc_code_count : c->ac_code_count, numcodes, codelengths);
+
+			// AT THIS POINT WE HAVE THE CODE LENGTH FOR EACH SYMBOL STORED IN codelengths
+
+			// NOW WE COUNT THE NUMBER OF CODES OF EACH LENGTH
+			// WE CAN POTENTIALLY HAVE CODES OF UP TO HUFF_MAX_CODE_LENGTH BITS AT THIS POINT
+			byte *num_codes_of_each_length = !dcac ? c->dc_code_length_count : c->ac_code_length_count;
+			memset(num_codes_of_each_length, 0, HUFF_MAX_CODE_LENGTH + 1);
+			int j = 0;
+			for (j = 0; j < numcodes; j++)
+			{
+				if (codelengths[j])
+					num_codes_of_each_length[codelengths[j]]++;
+			}
+
+#ifdef _JPEG_ENCODER_DEBUG
+
+// 			if (i == 0 && dcac == 0)
+// 			{
+//            printf("Component %d, dcac=%d\n", i, dcac);
+// 
+// 				for (j = 0; j < numcodes; j++)
+// 				{
+// 					printf("Code size of symbol %X = %d\n", j, codelengths[j]);
+// 				}
+// 				printf("\n");
+// 				for (j = 0; j <= HUFF_MAX_CODE_LENGTH; j++)
+// 				{
+// 					printf("Number of codes of length %d : %d\n", j, num_codes_of_each_length[j]);
+// 				}
+
+//			}
+#endif
+		}
+	}
+}
+
+// Brings all codes down to at most 16 bits, following Figure K.3 in Annex K
+static void limit_code_lengths()
+{
+	int ncomp = 0;
+	for (ncomp = 0; ncomp < iceenv.num_components; ncomp++)
+	{
+		struct jpeg_encode_component *c = &icecomp[ncomp];
+		byte *code_length_count = 0;
+		int dcac = 0;
+		for (dcac = 0; dcac < 2; dcac++)
+		{
+			code_length_count = !dcac ? c->dc_code_length_count : c->ac_code_length_count;
+
+			int i = HUFF_MAX_CODE_LENGTH, j;
+			
+			while (1)
+			{
+				if (!code_length_count[i])
+				{
+					i--;
+					if (i == 16)
+					{
+						// Below 16 we work our way down until we find a code length that is used
+						while (!code_length_count[i])
+							i--;
+
+						// This will be the maximum code length in use
+						// One must be subtracted from it because the "fake" code
+						// added during
+						// c->dc_code_count[16] = 1;
+						// c->ac_code_count[256] = 1;
+						// must be removed from the count
+						code_length_count[i]--;
+
+						break;
+					}
+					else
+					{
+						continue;
+					}
+				}
+
+				j = i - 1;
+				j--;
+				while (!code_length_count[j])
+					j--;
+
+				code_length_count[i] -= 2;
+				code_length_count[i - 1]++;
+				code_length_count[j + 1] += 2;
+				code_length_count[j]--;
+			}
+
+#ifdef _JPEG_ENCODER_DEBUG
+//			if (ncomp == 0 && dcac == 0)
+//			{
+//				int dbg = 0;
+//				for (dbg = 0; dbg <= HUFF_MAX_CODE_LENGTH; dbg++)
+//				{
+//					printf("Number of codes of length %d : %d\n", dbg, code_length_count[dbg]);
+//				}
+//			}
+#endif
+		}
+	}
+}
+
+// static void sort_codes()
+//
+// Here we generate a sorted list of symbols
+// sort criterion is the symbol's VLC code length, symbols of the same
+// length are in ascending order
+static void sort_codes()
+{
+	int ncomp = 0;
+	for (ncomp = 0; ncomp < iceenv.num_components; ncomp++)
+	{
+		struct jpeg_encode_component *c = &icecomp[ncomp];
+		int dcac = 0;
+		for (dcac = 0; dcac < 2; dcac++)
+		{
+			const byte *codelengths = !dcac ? c->dc_code_lengths : c->ac_code_lengths;
+			byte *huffval = !dcac ? c->dc_huffval : c->ac_huffval;
+			int numcodes = !dcac ? 16 : 256;
+			// Position of the next symbol of each length
+			int next[HUFF_MAX_CODE_LENGTH + 1];
+			int i, j;
+
+			memset(huffval, 0, sizeof(byte) * numcodes);
+			memset(next, 0, sizeof(next));
+
+			// Counting sort: count the symbols of each length, which gives
+			// the start of each length in the list
+			for (j = 0; j < numcodes; j++)
+			{
+				if (codelengths[j])
+					next[codelengths[j]]++;
+			}
+			int pos = 0;
+			for (i = 1; i <= HUFF_MAX_CODE_LENGTH; i++)
+			{
+				int count = next[i];
+				next[i] = pos;
+				pos += count;
+			}
+
+			for (j = 0; j < numcodes; j++)
+			{
+				if (codelengths[j])
+					huffval[next[codelengths[j]]++] = j;
+			}
+            
+#ifdef _JPEG_ENCODER_DEBUG
+//			if (ncomp == 0 && dcac == 0)
+//			{
+
+				for (j = 0; j < numcodes; j++)
+				{
+					printf("Position %d -> Code %d\n", j, huffval[j]);
+				}
+				printf("\n");
+//			}
+#endif
+
+		}
+	}
+}
+
+// Here we create the JPEG style DHT data
+// which can be used by the function get_huffman_tables() from the
+// decoder to generate out bitstrings
+static void gen_DHT(void)
+{
+    int ncomp = 0;
+    for (ncomp = 0; ncomp < iceenv.num_components; ncomp++)
+    {
+        struct jpeg_encode_component *c = &icecomp[ncomp];
+        int dcac = 0;
+        int numcodes = 0;
+        struct jpeg_dht *dht = 0;
+        byte *codelength_count = 0;
+        for (dcac = 0; dcac < 2; dcac++)
+        {
+            dht = !dcac ? &c->dc_dht : &c->ac_dht;
+            codelength_count = !dcac ? c->dc_code_length_count : c->ac_code_length_count;
+            numcodes = !dcac ? 16 : 256;
+            
+            byte codes_total = 0;
+            int i = 0;
+            for (i = 0; i < 16; i++)
+            {
+                dht->num_codes[i] = codelength_count[i+1];
+                codes_total += dht->num_codes[i];
+            }
+            
+            free(dht->codes);
+            dht->codes = (byte*) malloc(codes_total);
+            memcpy(dht->codes, !dcac ? c->dc_huffval : c->ac_huffval, codes_total);
+            
+            if (!dcac)
+               iceenv.dc_huff_numcodes[ncomp] = codes_total;
+            else
+               iceenv.ac_huff_numcodes[ncomp] = codes_total;
+
+        }
+    }
+}
+
+// Here we finally create the 2 global DC Huffman tables and 2 AC Huffman tables
+// which can be used for encoding
+static int gen_huffman_tables(void)
+{
+	int i, j, k;
+
+	struct jpeg_dht* cur_src_table = 0;
+	struct jpeg_huffman_code* cur_dst_table = 0;
+
+	// Loop over all 2 tables
+	for (i = 0; i < 3 + 3; i++)
+	{
+		if (i >= 0 && i < 3)
+		{
+			cur_src_table = &icecomp[i].dc_dht;
+		}
+		else
+		{
+			cur_src_table = &icecomp[i - 3].ac_dht;
+		}
+
+		if (!cur_src_table)
+			continue;
+
+		word cur_bitstring = 0;
+		byte cur_length = 0;
+
+		if (i >= 0 && i < 3)
+		{
+			cur_dst_table = iceenv.dc_huff[i];
+		}
+		else
+		{
+			cur_dst_table = iceenv.ac_huff[i - 3];
+		}
+		memset(cur_dst_table, 0, (i < 3 ? 16 : 256) * sizeof(struct jpeg_huffman_code));
+
+		byte *symbols = cur_src_table->codes;
+
+		// Loop over all 16 code lengths
+		for (j = 0; j < 16; j++)
+		{
+			cur_length = j + 1;
+
+#ifdef _JPEG_ENCODER_DEBUG
+			printf("Codes of length %d bits:\n", cur_length);
+#endif
+			// Loop over all codes of length j
+			for (k = 0; k < cur_src_table->num_codes[j]; k++)
+			{
+				cur_dst_table[*symbols].length = cur_length;
+				cur_dst_table[*symbols].code = cur_bitstring;
+
+#ifdef _JPEG_ENCODER_DEBUG
+				printf("\t");
+				int l;
+				for (l = cur_length - 1; l >= 0; l--)
+				{
+					printf("%d", (cur_bitstring & (1 << l)) >> l);
+				}
+				printf(" -> %X\n", *symbols);
+#endif
+
+				symbols++;
+				cur_bitstring++;
+
+			}
+			cur_bitstring <<= 1;
+		}
+#ifdef _JPEG_ENCODER_DEBUG
+		printf("\n");
+#endif
+	}
+
+	return ERR_OK;
+}
+
+// Builds optimized Huffman tables from the symbol statistics of the workers
+static void build_optimized_tables(void)
+{
+	find_code_lengths();
+	limit_code_lengths();
+	sort_codes();
+	gen_DHT();
+	gen_huffman_tables();
+}
+
+// Makes sure that at least size more bytes fit into the scan buffer
+static int reserve_scan_buffer(struct jpeg_bit_writer *bw, int size)
+{
+    if (bw->pos + size > bw->size)
+    {
+        int new_size = max(bw->size * 2, bw->pos + size);
+        byte *new_buffer = (byte*) realloc(bw->buffer, new_size);
+		if (!new_buffer)
+			return ERR_OUT_OF_MEMORY;
+        bw->buffer = new_buffer;
+        bw->size = new_size;
+    }
+    return ERR_OK;
+}
+
+// Writes the 4 bytes of a word to the scan buffer, inserting a stuff byte
+// after each 0xFF. Most words don't contain 0xFF at all, those are copied
+// without looking at the individual bytes.
+static inline void emit_word(struct jpeg_bit_writer *bw, uint32_t word)
+{
+    byte *out = bw->buffer + bw->pos;
+    // Zero byte test on the inverted word finds 0xFF bytes
+    if (!((~word - 0x01010101) & word & 0x80808080))
+    {
+        out[0] = (byte)(word >> 24);
+        out[1] = (byte)(word >> 16);
+        out[2] = (byte)(word >> 8);
+        out[3] = (byte)word;
+        bw->pos += 4;
+        return;
+    }
+
+    int i;
+    for (i = 24; i >= 0; i -= 8)
+    {
+        byte b = (byte)(word >> i);
+        *out++ = b;
+        if (b == 0xFF)
+            *out++ = 0;
+    }
+    bw->pos = (int)(out - bw->buffer);
+}
+
+// Writes a bit string of a given length to the bit stream. Up to 32 bits can
+// be written at once, so a Huffman code and its magnitude bits are emitted
+// together.
+static inline int write_bits(struct jpeg_bit_writer *bw, uint32_t value, int length)
+{
+    bw->put_buffer = (bw->put_buffer << length) | (value & (uint32_t)((1ULL << length) - 1));
+    bw->put_bits += length;
+
+    if (bw->put_bits >= 32)
+    {
+        // Worst case: 4 bytes that all need to be stuffed
+        if (bw->pos + 8 > bw->size && reserve_scan_buffer(bw, 8))
+            return ERR_OUT_OF_MEMORY;
+        bw->put_bits -= 32;
+        emit_word(bw, (uint32_t)(bw->put_buffer >> bw->put_bits));
+    }
+
+	return ERR_OK;
+}
+
+// Pads the bit stream to the next byte boundary with 1-bits and writes out
+// all complete bytes still held in the accumulator
+inline static int fill_current_byte(struct jpeg_bit_writer *bw)
+{
+    if (bw->put_bits & 7)
+        write_bits(bw, 0xFF, 8 - (bw->put_bits & 7));
+
+    if (reserve_scan_buffer(bw, 8))
+        return ERR_OUT_OF_MEMORY;
+
+    while (bw->put_bits)
+    {
+        bw->put_bits -= 8;
+        byte b = (byte)(bw->put_buffer >> bw->put_bits);
+        bw->buffer[bw->pos++] = b;
+        if (b == 0xFF)
+            bw->buffer[bw->pos++] = 0;
+    }
+    return ERR_OK;
+}
+
+inline static int write_rst_marker(struct jpeg_bit_writer *bw, int marker)
+{
+    if (fill_current_byte(bw) || reserve_scan_buffer(bw, 2))
+        return ERR_OUT_OF_MEMORY;
+    bw->buffer[bw->pos++] = 0xFF;
+    bw->buffer[bw->pos++] = 0xD0 | marker;
+    return ERR_OK;
+}
+
+// Hands all complete bytes of the scan buffer to the output sink
+static int flush_scan_buffer(struct jpeg_bit_writer *bw)
+{
+    int err = sink_write(bw->buffer, sizeof(byte), bw->pos);
+    bw->flushed += bw->pos;
+    bw->pos = 0;
+    if (err)
+        return err;
+    return sink_flush();
+}
+
+// Returns an estimate of the scan size in bytes that the symbols of a
+// worker and the Huffman tables will produce. The exact number of bits is
+// known, only the stuff bytes have to be guessed.
+static int estimate_scan_size(struct jpeg_encode_worker *w)
+{
+    int64_t bits = 0;
+    int i;
+    for (i = 0; i < iceenv.num_components; i++)
+    {
+        int j;
+        for (j = 0; j < 16; j++)
+            bits += (int64_t)w->dc_code_count[i][j] * (iceenv.dc_huff[i][j].length + j);
+        for (j = 0; j < 256; j++)
+            bits += (int64_t)w->ac_code_count[i][j] * (iceenv.ac_huff[i][j].length + LWR4(j));
+    }
+
+    int64_t bytes = (bits + 7) >> 3;
+    // Allow for roughly one stuff byte in 64, plus restart markers
+    bytes += (bytes >> 6) + 16;
+    if (iceenv.use_rst_markers && iceenv.restart_interval)
+        bytes += 2 * ((w->end - w->first) / iceenv.restart_interval + 1);
+
+    return bytes > INT_MAX ? INT_MAX : (int)bytes;
+}
+
+// Allocates the scan buffer of a bit writer
+static int init_bit_writer(struct jpeg_bit_writer *bw, int size)
+{
+	free(bw->buffer);
+	bw->size = size;
+	bw->buffer = (byte*) malloc(bw->size);
+	if (!bw->buffer)
+		return ERR_OUT_OF_MEMORY;
+	bw->pos = bw->flushed = 0;
+	bw->put_buffer = 0;
+	bw->put_bits = 0;
+	return ERR_OK;
+}
+
+// Entropy codes the symbols of the MCUs [w->first, w->end) into bw.
+// In serial mode each restart interval is passed on to the output as
+// soon as it is complete.
+static int code_symbols(struct jpeg_encode_worker *w, struct jpeg_bit_writer *bw, int flush)
+{
+	int rlc_index[3] = { 0, 0, 0 };
+	int mcu, i, err;
+
+	// Encode every MCU
+	for (mcu = w->first; mcu < w->end; mcu++)
+	{
+		for (i = 0; i < iceenv.num_components; i++)
+		{
+			struct jpeg_encode_component *c = &icecomp[i];
+			int is_dc = 1;
+			int du_index = 0;
+			int num_du_per_mcu = c->sx * c->sy;
+			struct jpeg_huffman_code *huff_table = 0;
+			struct jpeg_zrlc* cur_rlc;
+
+			while (num_du_per_mcu)
+			{
+				huff_table = is_dc ? iceenv.dc_huff[i] : iceenv.ac_huff[i];
+				cur_rlc = &w->rlc[i][rlc_index[i]++];
+
+				if (is_dc) is_dc = 0;
+
+				if (!huff_table[cur_rlc->info].length)
+					return ERR_NO_HUFFMAN_CODE_FOR_SYMBOL;
+
+				// Huffman code and magnitude bits in one go, EOB has no magnitude bits
+				if (cur_rlc->length == 0xFF)
+					err = write_bits(bw, huff_table[cur_rlc->info].code, huff_table[cur_rlc->info].length);
+				else
+					err = write_bits(bw, ((uint32_t)huff_table[cur_rlc->info].code << cur_rlc->length) | (uint32_t)cur_rlc->bits,
+									 huff_table[cur_rlc->info].length + cur_rlc->length);
+				if (err)
+					return err;
+                
+				du_index += UPR4(cur_rlc->info);
+				du_index++;
+				// Reset index if we've processed all 64 samples OR encountered an EOB
+				if (du_index == 64 || cur_rlc->length == 0xFF)
+				{
+					du_index = 0;
+					is_dc = 1;
+					num_du_per_mcu--;
+                }
+			}
+		}
+
+		if (ends_interval(mcu))
+		{
+			if (write_rst_marker(bw, rst_marker_after(mcu)))
+				return ERR_OUT_OF_MEMORY;
+			// Each restart interval is complete now, pass it on
+			if (flush)
+			{
+				err = flush_scan_buffer(bw);
+				if (err)
+					return err;
+			}
+		}
+	}
+
+	return ERR_OK;
+}
+
+// Codes the restart intervals of one worker into its own bit writer
+static void code_symbols_job(void *arg)
+{
+	struct jpeg_encode_worker *w = (struct jpeg_encode_worker*)arg;
+	struct jpeg_bit_writer *bw = &w->writer;
+
+	w->err = init_bit_writer(bw, estimate_scan_size(w));
+	if (!w->err)
+		w->err = code_symbols(w, bw, 0);
+	w->scan_bits = ((int64_t)bw->pos * 8) + bw->put_bits;
+	if (!w->err && fill_current_byte(bw))
+		w->err = ERR_OUT_OF_MEMORY;
+}
+
+static int create_bitstream()
+{
+	int i, err = ERR_OK;
+	int64_t scan_bits = 0;
+
+	if (iceenv.use_rst_markers && iceenv.num_coders > 1)
+	{
+		// Every worker codes its own restart intervals, then the pieces
+		// are put together in order
+		ice_run_parallel(code_symbols_job, iceenv.workers, sizeof(struct jpeg_encode_worker), iceenv.num_coders);
+		for (i = 0; i < iceenv.num_coders && !err; i++)
+			err = iceenv.workers[i].err;
+	}
+	else
+	{
+		// Serial: the symbols of all workers go into one continuous bit
+		// stream, restart intervals are passed on to the output one by one
+		struct jpeg_bit_writer *bw = &iceenv.workers[0].writer;
+		int size = 0;
+		for (i = 0; i < iceenv.num_coders; i++)
+			size = (int)min((int64_t)size + estimate_scan_size(&iceenv.workers[i]), INT_MAX);
+
+		err = init_bit_writer(bw, size);
+		for (i = 0; i < iceenv.num_coders && !err; i++)
+			err = code_symbols(&iceenv.workers[i], bw, 1);
+		if (!err)
+		{
+			iceenv.workers[0].scan_bits = ((int64_t)(bw->flushed + bw->pos) * 8) + bw->put_bits;
+			for (i = 1; i < iceenv.num_coders; i++)
+				iceenv.workers[i].scan_bits = 0;
+			if (fill_current_byte(bw))
+				err = ERR_OUT_OF_MEMORY;
+		}
+	}
+	if (err)
+		return err;
+
+	icestats.scan_segment_size = 0;
+	for (i = 0; i < iceenv.num_coders; i++)
+	{
+		struct jpeg_encode_worker *w = &iceenv.workers[i];
+		err = flush_scan_buffer(&w->writer);
+		if (err)
+			return err;
+		scan_bits += w->scan_bits;
+		icestats.scan_segment_size += w->writer.flushed;
+	}
+
+#ifdef _JPEG_ENCODER_DEBUG
+	printf("Finished bitstream at %d bytes\n", icestats.scan_segment_size);
+#endif
+
+#ifdef _JPEG_ENCODER_STATS
+	icestats.bits_per_pixel = (float)scan_bits / (float)(iceenv.width * iceenv.height);
+	icestats.compression_ratio = icestats.bits_per_pixel / 8.0f;
+	icestats.frame_bits = (int)min(scan_bits, INT_MAX);
+#endif
+	merge_block_cache_stats();
+
+	return ERR_OK;
+}
+
+static void encode_job(void *arg)
+{
+	struct jpeg_encode_worker *w = (struct jpeg_encode_worker*)arg;
+	int i;
+
+	// Ranges not starting a restart interval are coded as if the DC
+	// prediction started over, see fix_dc_prediction()
+	for (i = 0; i < iceenv.num_components; i++)
+		w->prev_dc[i] = 0;
+	w->err = encode_mcus(w, w->first, w->end, 0);
+}
+
+// Without restart markers, DC prediction runs through the whole image.
+// The first DC difference of each worker is computed against the last DC
+// value of the worker before it once all of them are done.
+static void fix_dc_prediction(void)
+{
+    int i, j;
+    for (i = 1; i < iceenv.num_coders; i++)
+    {
+        struct jpeg_encode_worker *w = &iceenv.workers[i];
+        if (iceenv.use_rst_markers && !(w->first % iceenv.restart_interval))
+            continue;
+
+        for (j = 0; j < iceenv.num_components; j++)
+        {
+            struct jpeg_zrlc *rlc = &w->rlc[j][0];
+            int dc_diff = get_bit_value(rlc->bits, LWR4(rlc->info)) - iceenv.workers[i - 1].prev_dc[j];
+            byte category = find_category(dc_diff);
+
+            w->dc_code_count[j][rlc->info]--;
+            w->dc_code_count[j][category]++;
+            rlc->info = category;
+            rlc->length = category;
+            rlc->bits = get_bit_coding(dc_diff, category);
+        }
+    }
+}
+
+// Counts the symbols of the sampled MCU rows [first, end), numbered among
+// the sampled rows. DC prediction starts over in every row, so the counts
+// don't depend on how the rows are split among the workers.
+static void sample_job(void *arg)
+{
+	struct jpeg_encode_worker *w = (struct jpeg_encode_worker*)arg;
+	int i, row;
+
+	for (row = w->first * iceenv.sample_step; row < w->end * iceenv.sample_step && !w->err; row += iceenv.sample_step)
+	{
+		for (i = 0; i < iceenv.num_components; i++)
+			w->prev_dc[i] = 0;
+		w->err = encode_mcus(w, row * iceenv.num_mcu_x, (row + 1) * iceenv.num_mcu_x, 0);
+	}
+}
+
+// Gathers the symbol statistics for the Huffman tables from a sample of
+// the MCU rows without storing any symbols
+static int sample_code_stats(void)
+{
+	int i, err = ERR_OK;
+
+	iceenv.sample_step = iceenv.num_mcu_y < HUFF_SAMPLE_MIN_ROWS ? 1 : HUFF_SAMPLE_STEP;
+	iceenv.num_coders = split_work((iceenv.num_mcu_y + iceenv.sample_step - 1) / iceenv.sample_step);
+	for (i = 0; i < iceenv.num_coders; i++)
+	{
+		memset(iceenv.workers[i].dc_code_count, 0, sizeof(iceenv.workers[i].dc_code_count));
+		memset(iceenv.workers[i].ac_code_count, 0, sizeof(iceenv.workers[i].ac_code_count));
+	}
+
+	iceenv.sampling = 1;
+	ice_run_parallel(sample_job, iceenv.workers, sizeof(struct jpeg_encode_worker), iceenv.num_coders);
+	iceenv.sampling = 0;
+	for (i = 0; i < iceenv.num_coders && !err; i++)
+		err = iceenv.workers[i].err;
+
+	return err;
+}
+
+static int encode(void)
+{
+    int i, err = ERR_OK;
+    int num_mcus = iceenv.num_mcu_x * iceenv.num_mcu_y;
+    // With restart markers every worker gets whole restart intervals,
+    // otherwise bands of MCU rows
+    int unit = iceenv.use_rst_markers ? iceenv.restart_interval : iceenv.num_mcu_x;
+
+    iceenv.num_coders = split_work((num_mcus + unit - 1) / unit);
+    for (i = 0; i < iceenv.num_coders; i++)
+    {
+        struct jpeg_encode_worker *w = &iceenv.workers[i];
+        w->first *= unit;
+        w->end = min(w->end * unit, num_mcus);
+        memset(w->rlc_count, 0, sizeof(w->rlc_count));
+        memset(w->dc_code_count, 0, sizeof(w->dc_code_count));
+        memset(w->ac_code_count, 0, sizeof(w->ac_code_count));
+    }
+
+    // Encode every MCU
+    ice_run_parallel(encode_job, iceenv.workers, sizeof(struct jpeg_encode_worker), iceenv.num_coders);
+    for (i = 0; i < iceenv.num_coders && !err; i++)
+        err = iceenv.workers[i].err;
+    if (!err)
+        fix_dc_prediction();
+    
+    return err;
+}
+
+//************************************************************
+// SINGLE PASS ENCODING
+//************************************************************
+
+// Pads and flushes the scan written by the first worker and fills in
+// the statistics
+static int finish_single_pass_scan(void)
+{
+	struct jpeg_bit_writer *bw = &iceenv.workers[0].writer;
+	int err;
+
+#ifdef _JPEG_ENCODER_STATS
+	int64_t scan_bits = ((int64_t)(bw->flushed + bw->pos) * 8) + bw->put_bits;
+	icestats.bits_per_pixel = (float)scan_bits / (float)(iceenv.width * iceenv.height);
+	icestats.compression_ratio = icestats.bits_per_pixel / 8.0f;
+	icestats.frame_bits = (int)min(scan_bits, INT_MAX);
+#endif
+	merge_block_cache_stats();
+
+	if (fill_current_byte(bw))
+		return ERR_OUT_OF_MEMORY;
+	err = flush_scan_buffer(bw);
+	if (err)
+		return err;
+
+	icestats.scan_segment_size = bw->flushed;
+
+	return ERR_OK;
+}
+
+// Transforms all MCUs of an MCU row into its slot
+static void pipeline_transform_row(struct jpeg_encode_worker *w, int row)
+{
+	struct jpeg_transform_pipeline *p = &iceenv.pipeline;
+	int16_t *blocks = p->slots + (size_t)(row % p->num_slots) * p->slot_size;
+	int mcu;
+
+	for (mcu = row * iceenv.num_mcu_x; mcu < (row + 1) * iceenv.num_mcu_x; mcu++, blocks += iceenv.blocks_per_mcu * 64)
+		transform_mcu(w, mcu, 0, blocks);
+}
+
+// Transforms the next MCU row if its slot is free. Must be called with the
+// lock held, which is released while transforming. Returns 0 if there was
+// nothing to do.
+static int pipeline_work(struct jpeg_encode_worker *w)
+{
+	struct jpeg_transform_pipeline *p = &iceenv.pipeline;
+	int row;
+
+	if (p->abort || p->next_row >= iceenv.num_mcu_y || p->next_row - p->rows_coded >= p->num_slots)
+		return 0;
+
+	row = p->next_row++;
+	ice_mutex_unlock(&p->lock);
+	pipeline_transform_row(w, row);
+	ice_mutex_lock(&p->lock);
+
+	p->slot_row[row % p->num_slots] = row;
+	ice_cond_broadcast(&p->changed);
+	return 1;
+}
+
+// Codes the MCU rows in order. Whenever the next row isn't ready yet, this
+// thread helps with the transform, so it gets done even if no other thread
+// could be started.
+static int pipeline_code_rows(struct jpeg_encode_worker *w)
+{
+	struct jpeg_transform_pipeline *p = &iceenv.pipeline;
+	int row, mcu, err = ERR_OK;
+
+	for (row = 0; row < iceenv.num_mcu_y && !err; row++)
+	{
+		const int16_t *blocks;
+
+		ice_mutex_lock(&p->lock);
+		while (p->slot_row[row % p->num_slots] != row)
+		{
+			if (!pipeline_work(w))
+				ice_cond_wait(&p->changed, &p->lock);
+		}
+		ice_mutex_unlock(&p->lock);
+
+		blocks = p->slots + (size_t)(row % p->num_slots) * p->slot_size;
+		for (mcu = row * iceenv.num_mcu_x; mcu < (row + 1) * iceenv.num_mcu_x && !err; mcu++, blocks += iceenv.blocks_per_mcu * 64)
+			err = code_mcu(w, mcu, blocks);
+		if (!err)
+			err = flush_scan_buffer(&w->writer);
+
+		ice_mutex_lock(&p->lock);
+		if (err)
+			p->abort = 1;
+		p->slot_row[row % p->num_slots] = -1;
+		p->rows_coded++;
+		ice_cond_broadcast(&p->changed);
+		ice_mutex_unlock(&p->lock);
+	}
+
+	return err;
+}
+
+static void pipeline_job(void *arg)
+{
+	struct jpeg_encode_worker *w = (struct jpeg_encode_worker*)arg;
+	struct jpeg_transform_pipeline *p = &iceenv.pipeline;
+
+	if (w == iceenv.workers)
+	{
+		w->err = pipeline_code_rows(w);
+		return;
+	}
+
+	ice_mutex_lock(&p->lock);
+	while (!p->abort && p->next_row < iceenv.num_mcu_y)
+	{
+		if (!pipeline_work(w))
+			ice_cond_wait(&p->changed, &p->lock);
+	}
+	ice_mutex_unlock(&p->lock);
+}
+
+// Encodes the whole image with the standard Huffman tables, passing on each
+// MCU row as soon as it is coded. Only DC prediction and entropy coding have
+// to be done in order, so with several threads the transform of the following
+// MCU rows is done in parallel while the first thread codes.
+static int encode_single_pass(void)
+{
+	struct jpeg_encode_worker *w = &iceenv.workers[0];
+	struct jpeg_transform_pipeline *p = &iceenv.pipeline;
+	int i, err;
+
+	err = init_bit_writer(&w->writer, 0xFFFF);
+	if (err)
+		return err;
+	for (i = 0; i < iceenv.num_components; i++)
+		w->prev_dc[i] = 0;
+
+	if (iceenv.num_workers < 2 || iceenv.num_mcu_y < 2)
+	{
+		for (i = 0; i < iceenv.num_mcu_y && !err; i++)
+		{
+			err = encode_mcus(w, i * iceenv.num_mcu_x, (i + 1) * iceenv.num_mcu_x, 0);
+			if (!err)
+				err = flush_scan_buffer(&w->writer);
+		}
+	}
+	else
+	{
+		// Enough slots so every thread can work ahead a bit
+		p->num_slots = iceenv.num_workers * 2;
+		p->slot_size = iceenv.num_mcu_x * iceenv.blocks_per_mcu * 64;
+		p->slots = (int16_t*)malloc((size_t)p->num_slots * p->slot_size * sizeof(int16_t));
+		p->slot_row = (int*)malloc(p->num_slots * sizeof(int));
+		if (!p->slots || !p->slot_row)
+			err = ERR_OUT_OF_MEMORY;
+		else if (ice_mutex_init(&p->lock))
+			err = ERR_OUT_OF_MEMORY;
+		else if (ice_cond_init(&p->changed))
+		{
+			ice_mutex_destroy(&p->lock);
+			err = ERR_OUT_OF_MEMORY;
+		}
+
+		if (!err)
+		{
+			for (i = 0; i < p->num_slots; i++)
+				p->slot_row[i] = -1;
+			p->next_row = p->rows_coded = p->abort = 0;
+
+			ice_run_parallel(pipeline_job, iceenv.workers, sizeof(struct jpeg_encode_worker), iceenv.num_workers);
+			err = w->err;
+
+			ice_cond_destroy(&p->changed);
+			ice_mutex_destroy(&p->lock);
+		}
+
+		free(p->slots);
+		free(p->slot_row);
+		p->slots = 0;
+		p->slot_row = 0;
+	}
+
+	if (err)
+		return err;
+	return finish_single_pass_scan();
+}
+
+//************************************************************
+// TARGET FILE SIZE
+//************************************************************
+
+// Performs the DCT of the MCUs [first, end) into dct_blocks
+static void dct_job(void *arg)
+{
+	struct jpeg_encode_worker *w = (struct jpeg_encode_worker*)arg;
+	int mcu, i, sx, sy, x, y;
+
+	for (mcu = w->first; mcu < w->end; mcu++)
+	{
+		int mcu_x = mcu % iceenv.num_mcu_x;
+		int mcu_y = mcu / iceenv.num_mcu_x;
+		DCTELEM *data = iceenv.dct_blocks + ((size_t)mcu * iceenv.blocks_per_mcu * 64);
+
+		for (i = 0; i < iceenv.num_components; i++)
+		{
+			struct jpeg_encode_component *c = &icecomp[i];
+			for (sy = 0; sy < c->sy; sy++)
+			{
+				for (sx = 0; sx < c->sx; sx++, data += 64)
+				{
+					const int16_t *origin = c->pixels + ((mcu_y * (c->sy << 3) + (sy << 3)) * c->stride) + (mcu_x * (c->sx << 3) + (sx << 3));
+					for (y = 0; y < 8; y++, origin += c->stride)
+					{
+						for (x = 0; x < 8; x++)
+							data[(y * 8) + x] = origin[x];
+					}
+					if (iceenv.fast_dct)
+						fdct_fast(data);
+					else
+						fdct(data);
+				}
+			}
+		}
+	}
+}
+
+// Counts the symbols of the MCUs [first, end) at the current quality
+static void estimate_job(void *arg)
+{
+	struct jpeg_encode_worker *w = (struct jpeg_encode_worker*)arg;
+	int mcu, i;
+
+	memset(w->dc_code_count, 0, sizeof(w->dc_code_count));
+	memset(w->ac_code_count, 0, sizeof(w->ac_code_count));
+	for (i = 0; i < iceenv.num_components; i++)
+		w->prev_dc[i] = 0;
+
+	// DC prediction continues from the last DUs of the MCU in front
+	if (w->first && !(iceenv.use_rst_markers && !(w->first % iceenv.restart_interval)))
+	{
+		const int16_t *block = w->mcu_blocks;
+		quantize_mcu(w->first - 1, w->mcu_blocks, 0);
+		for (i = 0; i < iceenv.num_components; i++)
+		{
+			block += ((icecomp[i].sx * icecomp[i].sy) - 1) * 64;
+			w->prev_dc[i] = block[0];
+			block += 64;
+		}
+	}
+
+	for (mcu = w->first; mcu < w->end && !w->err; mcu++)
+	{
+		quantize_mcu(mcu, w->mcu_blocks, 0);
+		w->err = code_mcu(w, mcu, w->mcu_blocks);
+	}
+}
+
+// Estimates the size of the file at the current quality from the symbol
+// counts. Only the 16 bit limit of the optimized code lengths, byte stuffing
+// and the padding in front of restart markers are approximated.
+static int estimate_file_size(void)
+{
+	int num_mcus = iceenv.num_mcu_x * iceenv.num_mcu_y;
+	int count = split_work(num_mcus);
+	int single_pass = iceenv.single_pass;
+	int num_symbols = 0;
+	int64_t bits = 0, size;
+	int i, j, k, dcac;
+
+	iceenv.single_pass = 0;
+	iceenv.sampling = 1;
+	ice_run_parallel(estimate_job, iceenv.workers, sizeof(struct jpeg_encode_worker), count);
+	iceenv.sampling = 0;
+	iceenv.single_pass = single_pass;
+
+	for (i = 0; i < iceenv.num_components; i++)
+	{
+		for (dcac = 0; dcac < 2; dcac++)
+		{
+			int numcodes = !dcac ? 16 : 256;
+			int codecount[257];
+			byte codelengths[257];
+
+			memset(codecount, 0, sizeof(codecount));
+			for (k = 0; k < count; k++)
+			{
+				const int *worker_count = !dcac ? iceenv.workers[k].dc_code_count[i] : iceenv.workers[k].ac_code_count[i];
+				for (j = 0; j < numcodes; j++)
+					codecount[j] += worker_count[j];
+			}
+
+			if (iceenv.standard_tables)
+			{
+				const struct jpeg_huffman_code *table = !dcac ? iceenv.dc_huff[i] : iceenv.ac_huff[i];
+				for (j = 0; j < numcodes; j++)
+					codelengths[j] = table[j].length;
+				num_symbols += !dcac ? iceenv.dc_huff_numcodes[i] : iceenv.ac_huff_numcodes[i];
+			}
+			else
+			{
+				codecount[numcodes] = 1;
+				build_code_lengths(codecount, numcodes + 1, codelengths);
+				for (j = 0; j < numcodes; j++)
+					num_symbols += codecount[j] > 0;
+			}
+
+			// Code plus additional bits, whose number is the category
+			for (j = 0; j < numcodes; j++)
+				bits += (int64_t)codecount[j] * (codelengths[j] + LWR4(j));
+		}
+	}
+
+	size = (bits + 7) >> 3;
+	// A stuffed 0 byte follows every 0xFF
+	size += size >> 8;
+	if (iceenv.use_rst_markers)
+		size += ((num_mcus - 1) / iceenv.restart_interval) * 3;
+
+	// SOI, APP0, DQT, DHT, DRI, SOF0, SOS and EOI
+	size += 2 + (4 + sizeof(struct jpeg_app0)) + (4 + iceenv.num_quant_tables * 65) +
+			(4 + iceenv.num_components * 2 * 17 + num_symbols) + (iceenv.use_rst_markers ? 6 : 0) +
+			(10 + iceenv.num_components * 3) + (8 + iceenv.num_components * 2) + 2;
+
+	return (int)min(size, INT_MAX);
+}
+
+// Performs the DCT of all DUs once and keeps the output in dct_blocks,
+// from which they are quantized from now on
+static int keep_dct_output(void)
+{
+	int num_mcus = iceenv.num_mcu_x * iceenv.num_mcu_y;
+
+	if (iceenv.dct_blocks)
+		return ERR_OK;
+	iceenv.dct_blocks = (DCTELEM*)malloc((size_t)num_mcus * iceenv.blocks_per_mcu * 64 * sizeof(DCTELEM));
+	if (!iceenv.dct_blocks)
+		return ERR_OUT_OF_MEMORY;
+	ice_run_parallel(dct_job, iceenv.workers, sizeof(struct jpeg_encode_worker), split_work(num_mcus));
+
+	return ERR_OK;
+}
+
+// Finds the highest quality at which the file is estimated to fit into
+// target_size bytes by a binary search. The DCT is only done once, every
+// step just quantizes the kept DCT output and counts the symbols. The
+// image is coded from the kept DCT output afterwards as well.
+static int choose_quality(void)
+{
+	int low = 1, high = 100, best = 1, best_size = 0;
+	int iterations = 0;
+	int err = keep_dct_output();
+	if (err)
+		return err;
+
+	// Quality 1 is used if nothing fits, it is only tried if all
+	// higher qualities are too large
+	while (low <= high)
+	{
+		int quality = (low + high) >> 1;
+		int size;
+		icejpeg_setquality((unsigned char)quality);
+		size = estimate_file_size();
+		iterations++;
+		if (size <= iceenv.target_size || quality == 1)
+		{
+			best = quality;
+			best_size = size;
+			low = quality + 1;
+		}
+		else
+			high = quality - 1;
+	}
+	icejpeg_setquality((unsigned char)best);
+
+#ifdef _JPEG_ENCODER_STATS
+	icestats.target_size_iterations = iterations;
+	icestats.estimated_size = best_size;
+	icestats.target_size_missed = best_size > iceenv.target_size;
+#else
+	(void)best_size;
+	(void)iterations;
+#endif
+
+	return ERR_OK;
+}
+
+//************************************************************
+// RATE CONTROL
+//************************************************************
+
+// Builds the quantization factors of the rate control levels and the
+// interval statistics. Level 0 has the frame's factors, every further level
+// scales the quality scale factor by 5/4; quality 100 gets the levels of
+// quality 95. The DC coefficients always keep the frame's steps, coarser
+// ones would show up as blocking.
+static int setup_rate_control(void)
+{
+	int num_mcus = iceenv.num_mcu_x * iceenv.num_mcu_y;
+	int unit = iceenv.use_rst_markers ? iceenv.restart_interval : iceenv.num_mcu_x;
+	int scale = 100;
+	int level, i, j;
+
+	for (level = 0; level < RC_NUM_LEVELS; level++, scale = scale * 5 / 4)
+	{
+		int scale_factor = max(iceenv.quality_scale_factor, 10) * scale / 100;
+		for (i = 0; i < 3; i++)
+		{
+			for (j = 0; j < 64; j++)
+			{
+				int factor = CLAMPQNT((scale_factor * jpeg_qtbl_selector[i][j] + 50) / 100);
+				if (!level || !j || factor < iceenv.quant_factor[i][j])
+					factor = iceenv.quant_factor[i][j];
+				iceenv.rc_quant_factor[level][i][j] = factor;
+				iceenv.rc_fast_divisor[level][i][j] = max((factor * fdct_fast_scales[j] + (1 << 10)) >> 11, 1);
+			}
+		}
+	}
+
+	free(iceenv.rc_interval_bits);
+	free(iceenv.rc_interval_levels);
+	iceenv.rc_num_intervals = (num_mcus + unit - 1) / unit;
+	iceenv.rc_interval_bits = (int*)calloc(iceenv.rc_num_intervals, sizeof(int));
+	iceenv.rc_interval_levels = (byte*)calloc(iceenv.rc_num_intervals, sizeof(byte));
+	if (!iceenv.rc_interval_bits || !iceenv.rc_interval_levels)
+		return ERR_OUT_OF_MEMORY;
+
+	return ERR_OK;
+}
+
+// Returns the level for the next interval. The bits left are spread evenly
+// over the MCUs left, the level goes up or down depending on how far the
+// rate of the interval just coded is off from that.
+static int next_rate_control_level(int level, int64_t bits, int num_mcus, int64_t bits_left, int mcus_left)
+{
+	// Bits the interval would have had, and what it used, both times mcus_left
+	int64_t allowed = bits_left * num_mcus;
+	int64_t used = bits * mcus_left;
+
+	if (allowed <= 0)
+		return RC_NUM_LEVELS - 1;
+	if (used > allowed * 2)
+		level += 3;
+	else if (used > allowed + (allowed >> 1))
+		level += 2;
+	else if (used > allowed + (allowed >> 3))
+		level++;
+	else if (used < allowed - (allowed >> 2))
+		level--;
+
+	return min(max(level, 0), RC_NUM_LEVELS - 1);
+}
+
+// Quantizes and codes the MCUs first to end-1 at the given rate control level
+static int code_interval(struct jpeg_encode_worker *w, int first, int end, int level)
+{
+	int mcu, err;
+
+	for (mcu = first; mcu < end; mcu++)
+	{
+		quantize_mcu(mcu, w->mcu_blocks, level);
+		err = code_mcu(w, mcu, w->mcu_blocks);
+		if (err)
+			return err;
+	}
+	return ERR_OK;
+}
+
+// Codes the image in a single pass, keeping the file within frame_budget
+// bytes. The quantization gets coarser or finer from one restart interval
+// (or MCU row, without restart markers) to the next, depending on the bits
+// spent so far. What each interval takes at the coarsest level is measured
+// first and held back for the intervals still to come; an interval that
+// doesn't leave that much is coded again more coarsely. The DCT is done for
+// the whole image in parallel first, the rest is serial.
+static int encode_rate_controlled(void)
+{
+	struct jpeg_encode_worker *w = &iceenv.workers[0];
+	struct jpeg_bit_writer *bw = &w->writer;
+	int num_mcus = iceenv.num_mcu_x * iceenv.num_mcu_y;
+	int unit = iceenv.use_rst_markers ? iceenv.restart_interval : iceenv.num_mcu_x;
+	// The headers are already written, the scan gets the rest but the EOI
+	// and two bytes for padding the last bits, which may need a stuff byte
+	int64_t budget = ((int64_t)iceenv.frame_budget - iceenv.sink.bytes_written - 4) * 8;
+	int64_t spent = 0;
+	// Bits held back for the intervals after each interval
+	int64_t *reserve;
+	int level = 0;
+	int interval, i, err;
+
+	err = keep_dct_output();
+	if (!err)
+		err = setup_rate_control();
+	if (!err)
+		err = init_bit_writer(bw, 0xFFFF);
+	if (err)
+		return err;
+
+	reserve = (int64_t*)malloc(sizeof(int64_t) * iceenv.rc_num_intervals);
+	if (!reserve)
+		return ERR_OUT_OF_MEMORY;
+
+	// Trial run at the coarsest level, which stays in the buffer. The bits
+	// of an interval shift a little with the alignment and the stuff bytes
+	// it ends up with, hence the margin.
+	for (i = 0; i < iceenv.num_components; i++)
+		w->prev_dc[i] = 0;
+	for (interval = 0; interval < iceenv.rc_num_intervals && !err; interval++)
+	{
+		int64_t before = ((int64_t)bw->pos * 8) + bw->put_bits;
+		err = code_interval(w, interval * unit, min((interval + 1) * unit, num_mcus), RC_NUM_LEVELS - 1);
+		reserve[interval] = ((int64_t)bw->pos * 8) + bw->put_bits - before;
+		reserve[interval] += (reserve[interval] >> 7) + 16;
+	}
+	if (err)
+	{
+		free(reserve);
+		return err;
+	}
+	for (interval = iceenv.rc_num_intervals - 1; interval > 0; interval--)
+		reserve[interval - 1] += reserve[interval];
+	for (interval = 0; interval < iceenv.rc_num_intervals; interval++)
+		reserve[interval] = interval + 1 < iceenv.rc_num_intervals ? reserve[interval + 1] : 0;
+	bw->pos = 0;
+	bw->put_buffer = 0;
+	bw->put_bits = 0;
+
+	for (i = 0; i < iceenv.num_components; i++)
+		w->prev_dc[i] = 0;
+
+	for (interval = 0; interval < iceenv.rc_num_intervals; interval++)
+	{
+		int first = interval * unit;
+		int end = min(first + unit, num_mcus);
+		// Where the interval starts, to code it again
+		uint64_t put_buffer = bw->put_buffer;
+		int put_bits = bw->put_bits;
+		int prev_dc[3];
+		int64_t bits;
+
+		memcpy(prev_dc, w->prev_dc, sizeof(prev_dc));
+		for (;;)
+		{
+			err = code_interval(w, first, end, level);
+			if (err)
+				break;
+			bits = ((int64_t)(bw->flushed + bw->pos) * 8) + bw->put_bits - spent;
+			if (level == RC_NUM_LEVELS - 1 || spent + bits + reserve[interval] <= budget)
+				break;
+
+			bw->pos = 0;
+			bw->put_buffer = put_buffer;
+			bw->put_bits = put_bits;
+			memcpy(w->prev_dc, prev_dc, sizeof(prev_dc));
+			level++;
+		}
+		if (err)
+			break;
+
+		spent += bits;
+		iceenv.rc_interval_bits[interval] = (int)bits;
+		iceenv.rc_interval_levels[interval] = (byte)level;
+		err = flush_scan_buffer(bw);
+		if (err)
+			break;
+
+		if (end < num_mcus)
+			level = next_rate_control_level(level, bits, end - first, budget - spent, num_mcus - end);
+	}
+	free(reserve);
+	if (err)
+		return err;
+
+#ifdef _JPEG_ENCODER_STATS
+	icestats.frame_budget_bits = (int)min(max(budget, 0), INT_MAX);
+	icestats.frame_budget_exceeded = spent > budget;
+	icestats.num_intervals = iceenv.rc_num_intervals;
+	icestats.interval_bits = iceenv.rc_interval_bits;
+	icestats.interval_levels = iceenv.rc_interval_levels;
+#endif
+
+	return finish_single_pass_scan();
+}
+
+//************************************************************
+// TRELLIS QUANTIZATION
+//************************************************************
+
+// Returns the number of bits the symbols counted in icecomp take with
+// the current Huffman tables, not counting stuff bytes and padding
+static int64_t count_scan_bits(void)
+{
+	int64_t bits = 0;
+	int i, j;
+
+	for (i = 0; i < iceenv.num_components; i++)
+	{
+		for (j = 0; j < 16; j++)
+			bits += (int64_t)icecomp[i].dc_code_count[j] * (iceenv.dc_huff[i][j].length + j);
+		for (j = 0; j < 256; j++)
+			bits += (int64_t)icecomp[i].ac_code_count[j] * (iceenv.ac_huff[i][j].length + LWR4(j));
+	}
+
+	return bits;
+}
+
+// Encodes the image again, quantizing every DU with trellis_quantize_du()
+// against the tables built from the first pass, then builds the tables
+// anew from the symbols of this pass. The workers quantize their DUs in
+// parallel, just like in the first pass.
+static int trellis_pass(void)
+{
+	int64_t plain_bits = count_scan_bits();
+	int err;
+
+	reset_block_caches();
+	iceenv.trellis_active = 1;
+	err = encode();
+	iceenv.trellis_active = 0;
+	reset_block_caches();
+	if (err)
+		return err;
+	build_optimized_tables();
+
+#ifdef _JPEG_ENCODER_STATS
+	icestats.trellis_size_delta = (int)((count_scan_bits() - plain_bits) / 8);
+#else
+	(void)plain_bits;
+#endif
+
+	return ERR_OK;
+}
+
+//************************************************************
+// PROGRESSIVE ENCODING
+//************************************************************
+
+// Transforms the MCUs [first, end) into coef_blocks
+static void coef_job(void *arg)
+{
+	struct jpeg_encode_worker *w = (struct jpeg_encode_worker*)arg;
+	int mcu;
+
+	for (mcu = w->first; mcu < w->end; mcu++)
+		transform_mcu(w, mcu, 0, iceenv.coef_blocks + ((size_t)mcu * iceenv.blocks_per_mcu * 64));
+}
+
+// Returns the quantized DU in column x, row y of the DUs of component comp
+static inline const int16_t *coef_block(int comp, int x, int y)
+{
+	int mcu = ((y / icecomp[comp].sy) * iceenv.num_mcu_x) + (x / icecomp[comp].sx);
+	int index = ((y % icecomp[comp].sy) * icecomp[comp].sx) + (x % icecomp[comp].sx);
+	int i;
+
+	for (i = 0; i < comp; i++)
+		index += icecomp[i].sx * icecomp[i].sy;
+	return iceenv.coef_blocks + ((((size_t)mcu * iceenv.blocks_per_mcu) + index) * 64);
+}
+
+// Codes a run of end-of-band blocks, EOBRUN
+static inline int emit_eob_run(struct jpeg_encode_worker *w, int comp, int *eob_run)
+{
+	int length = 0;
+
+	if (!*eob_run)
+		return ERR_OK;
+	while (*eob_run >> (length + 1))
+		length++;
+	int err = emit_symbol(w, comp, 0, length, 0, *eob_run & ((1 << length) - 1), length);
+	*eob_run = 0;
+	return err;
+}
+
+// Codes the coefficients [ss, se] of a DU for the first time. Blocks
+// whose band ends in zeros are counted in eob_run.
+static int code_band(struct jpeg_encode_worker *w, int comp, const int16_t *block, int ss, int se, int *eob_run)
+{
+	int zeros = 0;
+	int k, err;
+
+	for (k = ss; k <= se; k++)
+	{
+		int value = block[k];
+		if (!value)
+		{
+			zeros++;
+			continue;
+		}
+
+		err = emit_eob_run(w, comp, eob_run);
+		if (err)
+			return err;
+		for (; zeros > 15; zeros -= 16)
+		{
+			err = emit_symbol(w, comp, 0, 15, 0, 0, 0);
+			if (err)
+				return err;
+		}
+
+		byte category = find_category(value);
+		err = emit_symbol(w, comp, 0, zeros, category, get_bit_coding(value, category), category);
+		if (err)
+			return err;
+		zeros = 0;
+	}
+
+	// EOBRUN is limited to 15 bits
+	if (zeros && ++(*eob_run) == 0x7FFF)
+		return emit_eob_run(w, comp, eob_run);
+
+	return ERR_OK;
+}
+
+// Codes a progressive scan. A scan of one component covers only the DUs
+// within the component, the others go through the image MCU by MCU. When
+// writing, the scan buffer is passed on to the output every now and then.
+static int code_scan(struct jpeg_encode_worker *w, const struct jpeg_scan_info *scan)
+{
+	int comp = scan->component[0];
+	int eob_run = 0;
+	int x, y, i, j, err = ERR_OK;
+
+	for (i = 0; i < iceenv.num_components; i++)
+		w->prev_dc[i] = 0;
+
+	if (scan->num_components == 1)
+	{
+		// Number of DUs needed to cover the component
+		int width = (((iceenv.width * icecomp[comp].sx) + iceenv.max_sx - 1) / iceenv.max_sx + 7) >> 3;
+		int height = (((iceenv.height * icecomp[comp].sy) + iceenv.max_sy - 1) / iceenv.max_sy + 7) >> 3;
+
+		for (y = 0; y < height && !err; y++)
+		{
+			for (x = 0; x < width && !err; x++)
+			{
+				const int16_t *block = coef_block(comp, x, y);
+				if (!scan->ss)
+					err = code_du_dc(w, comp, block);
+				else
+					err = code_band(w, comp, block, scan->ss, scan->se, &eob_run);
+			}
+			if (!err && iceenv.single_pass && w->writer.pos > 0xFFFF)
+				err = flush_scan_buffer(&w->writer);
+		}
+		if (!err)
+			err = emit_eob_run(w, comp, &eob_run);
+		return err;
+	}
+
+	for (y = 0; y < iceenv.num_mcu_y && !err; y++)
+	{
+		for (x = 0; x < iceenv.num_mcu_x && !err; x++)
+		{
+			for (i = 0; i < scan->num_components && !err; i++)
+			{
+				comp = scan->component[i];
+				for (j = 0; j < icecomp[comp].sx * icecomp[comp].sy && !err; j++)
+					err = code_du_dc(w, comp, coef_block(comp, (x * icecomp[comp].sx) + (j % icecomp[comp].sx), (y * icecomp[comp].sy) + (j / icecomp[comp].sx)));
+			}
+		}
+		if (!err && iceenv.single_pass && w->writer.pos > 0xFFFF)
+			err = flush_scan_buffer(&w->writer);
+	}
+
+	return err;
+}
+
+// Counts the symbols of the scans [first, end)
+static void count_scans_job(void *arg)
+{
+	struct jpeg_encode_worker *w = (struct jpeg_encode_worker*)arg;
+	int i;
+
+	for (i = w->first; i < w->end && !w->err; i++)
+	{
+		struct jpeg_encode_scan *scan = &iceenv.scans[i];
+		memset(w->dc_code_count, 0, sizeof(w->dc_code_count));
+		memset(w->ac_code_count, 0, sizeof(w->ac_code_count));
+		w->err = code_scan(w, &scan->info);
+		memcpy(scan->dc_code_count, w->dc_code_count, sizeof(scan->dc_code_count));
+		memcpy(scan->ac_code_count, w->ac_code_count, sizeof(scan->ac_code_count));
+	}
+}
+
+// Builds the optimized Huffman tables of a scan from its statistics. The
+// tables the scan doesn't use get a symbol, so they can be built as well.
+static void build_scan_tables(const struct jpeg_encode_scan *scan)
+{
+	struct jpeg_encode_worker *w = &iceenv.workers[0];
+	int i;
+
+	memcpy(w->dc_code_count, scan->dc_code_count, sizeof(w->dc_code_count));
+	memcpy(w->ac_code_count, scan->ac_code_count, sizeof(w->ac_code_count));
+	for (i = 0; i < iceenv.num_components; i++)
+	{
+		int j, used = 0;
+		for (j = 0; j < 16; j++)
+			used |= w->dc_code_count[i][j];
+		if (!used)
+			w->dc_code_count[i][0] = 1;
+		for (j = 0, used = 0; j < 256; j++)
+			used |= w->ac_code_count[i][j];
+		if (!used)
+			w->ac_code_count[i][0] = 1;
+	}
+
+	iceenv.num_coders = 1;
+	build_optimized_tables();
+}
+
+// Writes a progressive image: all DUs are transformed and the symbols of
+// all scans are counted in parallel, then each scan is coded in turn with
+// the tables built for it
+static int encode_progressive(void)
+{
+	struct jpeg_encode_worker *w = &iceenv.workers[0];
+	struct jpeg_bit_writer *bw = &w->writer;
+	int num_mcus = iceenv.num_mcu_x * iceenv.num_mcu_y;
+	int64_t scan_bits = 0;
+	int i, count, err = ERR_OK;
+
+	if (!iceenv.coef_blocks)
+	{
+		iceenv.coef_blocks = (int16_t*)malloc((size_t)num_mcus * iceenv.blocks_per_mcu * 64 * sizeof(int16_t));
+		if (!iceenv.coef_blocks)
+			return ERR_OUT_OF_MEMORY;
+	}
+	ice_run_parallel(coef_job, iceenv.workers, sizeof(struct jpeg_encode_worker), split_work(num_mcus));
+
+	iceenv.single_pass = 0;
+	iceenv.sampling = 1;
+	count = split_work(iceenv.num_scans);
+	ice_run_parallel(count_scans_job, iceenv.workers, sizeof(struct jpeg_encode_worker), count);
+	iceenv.sampling = 0;
+	for (i = 0; i < count && !err; i++)
+		err = iceenv.workers[i].err;
+	if (err)
+		return err;
+
+	iceenv.single_pass = 1;
+	icestats.scan_segment_size = 0;
+	for (i = 0; i < iceenv.num_scans && !err; i++)
+	{
+		struct jpeg_encode_scan *scan = &iceenv.scans[i];
+
+		build_scan_tables(scan);
+		write_scan_dht(&scan->info);
+		write_scan_sos(&scan->info);
+		err = init_bit_writer(bw, 0xFFFF);
+		if (!err)
+			err = code_scan(w, &scan->info);
+		if (err)
+			break;
+		scan_bits += ((int64_t)(bw->flushed + bw->pos) * 8) + bw->put_bits;
+		if (fill_current_byte(bw))
+			err = ERR_OUT_OF_MEMORY;
+		else
+			err = flush_scan_buffer(bw);
+		icestats.scan_segment_size += bw->flushed;
+	}
+	if (err)
+		return err;
+
+#ifdef _JPEG_ENCODER_STATS
+	icestats.bits_per_pixel = (float)scan_bits / (float)(iceenv.width * iceenv.height);
+	icestats.compression_ratio = icestats.bits_per_pixel / 8.0f;
+	icestats.frame_bits = (int)min(scan_bits, INT_MAX);
+#endif
+	merge_block_cache_stats();
+
+	return iceenv.sink.error;
+}
+
+// Performs RGB->YCbCr conversion of a single row of pixels. The order of
+// the color channels and an alpha channel, which is ignored, are taken
+// care of right here, so no repacking of the input is necessary.
+static void convert_row(const byte *image, int16_t *cur_image)
+{
+    const int red = iceenv.input_red;
+    const int blue = iceenv.input_blue;
+    const int bpp = iceenv.input_bpp;
+    int x;
+    for (x = 0; x < iceenv.width; x++)
+    {
+        if (iceenv.num_components == 3)
+        {
+            register int y = DESCALE(YR * image[red] + YG * image[1] + YB * image[blue]);
+            register int cb = DESCALE(CBR * image[red] + CBG * image[1] + CBB * image[blue]) + 128;
+            register int cr = DESCALE(CRR * image[red] + CRG * image[1] + CRB * image[blue]) + 128;
+            
+            *cur_image++ = y;
+            *cur_image++ = cb;
+            *cur_image++ = cr;
+            image += bpp;
+        }
+        else if (bpp == 1)
+        {
+            register int y = DESCALE(YR * image[0] + YG * image[0] + YB * image[0]);
+            
+            *cur_image++ = y;
+            image++;
+        }
+        else
+        {
+            *cur_image++ = DESCALE(YR * image[red] + YG * image[1] + YB * image[blue]);
+            image += bpp;
+        }
+    }
+}
+
+// Interleaves a row of the planar YCbCr input, which doesn't need any color
+// conversion. Subsampled chroma planes are scaled up by pixel replication.
+static void interleave_row(int y, int16_t *cur_image)
+{
+    int i, x;
+    for (i = 0; i < iceenv.num_components; i++)
+    {
+        int shift_x = iceenv.input_plane_width[i] < iceenv.width;
+        int shift_y = iceenv.input_plane_height[i] < iceenv.height;
+        const byte *src = iceenv.input_planes[i] + ((size_t)(y >> shift_y) * iceenv.input_plane_width[i]);
+        int16_t *dst = cur_image + i;
+        for (x = 0; x < iceenv.width; x++, dst += iceenv.num_components)
+            *dst = src[x >> shift_x];
+    }
+}
+
+// Converts the image rows [first, end)
+static void convert_job(void *arg)
+{
+    struct jpeg_encode_worker *w = (struct jpeg_encode_worker*)arg;
+    int y;
+    for (y = w->first; y < w->end; y++)
+    {
+        if (iceenv.input_planes[0])
+            interleave_row(y, source_row(y));
+        else
+            convert_row(iceenv.input + ((size_t)y * iceenv.width * iceenv.input_bpp), source_row(y));
+    }
+}
+
+int convert_to_ycbcbr(byte *image)
+{
+    // Copy image to our buffer and perform RGB->YCbCr conversion
+    iceenv.input = image;
+    ice_run_parallel(convert_job, iceenv.workers, sizeof(struct jpeg_encode_worker), split_work(iceenv.height));
+    iceenv.input = 0;
+    
+    return ERR_OK;
+}
+
+// Sets the restart interval as requested in the settings
+static void choose_restart_interval(void)
+{
+	int num_mcus = iceenv.num_mcu_x * iceenv.num_mcu_y;
+
+	if (iceenv.restart_setting > 0)
+	{
+		iceenv.restart_interval = iceenv.restart_setting;
+		return;
+	}
+
+	// One line of MCUs
+	iceenv.restart_interval = iceenv.num_mcu_x;
+	if (iceenv.restart_setting != ICEJPEG_RESTART_AUTO || iceenv.num_workers < 2)
+		return;
+
+	// Split the image into enough segments to keep all threads busy. Segments
+	// of whole MCU lines are preferred, as long as there are enough of them.
+	int segments = iceenv.num_workers * RST_SEGMENTS_PER_THREAD;
+	int interval = (num_mcus + segments - 1) / segments;
+	if (interval >= iceenv.num_mcu_x)
+		interval -= interval % iceenv.num_mcu_x;
+	iceenv.restart_interval = min(max(interval, 1), 0xFFFF);
+}
+
+// Scan script used for progressive encoding if the settings have none
+static const struct jpeg_scan_info default_scan_script[] = {
+	{ 3, { 0, 1, 2 }, 0, 0 },
+	{ 1, { 0 }, 1, 5 },
+	{ 1, { 1 }, 1, 63 },
+	{ 1, { 2 }, 1, 63 },
+	{ 1, { 0 }, 6, 63 }
+};
+
+static const struct jpeg_scan_info default_gray_scan_script[] = {
+	{ 1, { 0 }, 0, 0 },
+	{ 1, { 0 }, 1, 5 },
+	{ 1, { 0 }, 6, 63 }
+};
+
+// Takes over the scan script of a progressive image after checking that
+// it codes every coefficient exactly once, and the DC coefficients first
+static int setup_scans(const struct jpeg_scan_info *script, int num_scans)
+{
+	byte coded[3][64];
+	int i, j, k;
+
+	if (!script)
+	{
+		script = iceenv.num_components == 3 ? default_scan_script : default_gray_scan_script;
+		num_scans = iceenv.num_components == 3 ? 5 : 3;
+	}
+	if (num_scans < 1)
+		return ERR_INVALID_SCAN_SCRIPT;
+
+	memset(coded, 0, sizeof(coded));
+	for (i = 0; i < num_scans; i++)
+	{
+		const struct jpeg_scan_info *scan = &script[i];
+
+		if (scan->num_components < 1 || scan->num_components > (scan->ss ? 1 : iceenv.num_components))
+			return ERR_INVALID_SCAN_SCRIPT;
+		if (scan->ss ? scan->se < scan->ss || scan->se > 63 : scan->se)
+			return ERR_INVALID_SCAN_SCRIPT;
+
+		for (j = 0; j < scan->num_components; j++)
+		{
+			int comp = scan->component[j];
+			if (comp < 0 || comp >= iceenv.num_components || (j && comp <= scan->component[j - 1]))
+				return ERR_INVALID_SCAN_SCRIPT;
+			if (scan->ss && !coded[comp][0])
+				return ERR_INVALID_SCAN_SCRIPT;
+			for (k = scan->ss; k <= scan->se; k++)
+			{
+				if (coded[comp][k])
+					return ERR_INVALID_SCAN_SCRIPT;
+				coded[comp][k] = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < iceenv.num_components; i++)
+	{
+		for (k = 0; k < 64; k++)
+		{
+			if (!coded[i][k])
+				return ERR_INVALID_SCAN_SCRIPT;
+		}
+	}
+
+	iceenv.scans = (struct jpeg_encode_scan*)calloc(num_scans, sizeof(struct jpeg_encode_scan));
+	if (!iceenv.scans)
+		return ERR_OUT_OF_MEMORY;
+	iceenv.num_scans = num_scans;
+	for (i = 0; i < num_scans; i++)
+		iceenv.scans[i].info = script[i];
+
+	return ERR_OK;
+}
+
+// Validates the settings and sets up everything that doesn't depend on
+// whether the image is encoded at once or incrementally
+static int setup_encoder(char *filename, struct jpeg_encoder_settings *settings)
+{
+	memset(&iceenv, 0, sizeof(struct __ice_env));
+	memset(icecomp, 0, sizeof(struct jpeg_encode_component) * 3);
+
+	if (filename)
+	{
+		iceenv.sink.filename = (char*)malloc(strlen(filename) + 1);
+		if (!iceenv.sink.filename)
+			return ERR_OUT_OF_MEMORY;
+		strcpy(iceenv.sink.filename, filename);
+	}
+	if (settings->num_components != 1 && settings->num_components != 3)
+	{
+		return ERR_INVALID_NUMBER_OF_COMP;
+	}
+
+    int i = 0;
+    for (; i < settings->num_components; i++)
+    {
+        if (settings->sampling_factors[i].sx > 4 ||
+            settings->sampling_factors[i].sx & (settings->sampling_factors[i].sx - 1))
+            return ERR_INVALID_SAMPLING_FACTOR;
+
+        if (settings->sampling_factors[i].sy > 4 ||
+            settings->sampling_factors[i].sy & (settings->sampling_factors[i].sy - 1))
+            return ERR_INVALID_SAMPLING_FACTOR;
+    }
+    
+	if (settings->restart_interval < ICEJPEG_RESTART_AUTO || settings->restart_interval > 0xFFFF)
+		return ERR_INVALID_RESTART_INTERVAL;
+
+	if (settings->target_size < 0)
+		return ERR_INVALID_SETTINGS;
+	iceenv.target_size = settings->target_size;
+	if (settings->frame_budget < 0 || (settings->frame_budget && settings->target_size))
+		return ERR_INVALID_SETTINGS;
+	iceenv.frame_budget = settings->frame_budget;
+
+	iceenv.sampled_tables = settings->sampled_huffman_tables;
+	switch (settings->preset)
+	{
+		case ICEJPEG_PRESET_CUSTOM:
+			// The other presets ignore these fields
+			if (settings->chroma_filter != ICEJPEG_FILTER_BOX && settings->chroma_filter != ICEJPEG_FILTER_TRIANGLE)
+				return ERR_INVALID_SETTINGS;
+			iceenv.standard_tables = settings->standard_huffman_tables;
+			iceenv.fast_dct = settings->fast_dct;
+			iceenv.chroma_filter = settings->chroma_filter;
+			break;
+		case ICEJPEG_PRESET_FASTEST:
+			iceenv.standard_tables = 1;
+			iceenv.fast_dct = 1;
+			iceenv.chroma_filter = ICEJPEG_FILTER_BOX;
+			break;
+		case ICEJPEG_PRESET_BALANCED:
+			iceenv.standard_tables = 0;
+			iceenv.fast_dct = 0;
+			iceenv.chroma_filter = ICEJPEG_FILTER_BOX;
+			break;
+		case ICEJPEG_PRESET_SMALLEST:
+			iceenv.standard_tables = 0;
+			iceenv.fast_dct = 0;
+			iceenv.chroma_filter = ICEJPEG_FILTER_TRIANGLE;
+			break;
+		default:
+			return ERR_INVALID_SETTINGS;
+	}
+	// Rate control needs to know the size of each interval right away
+	if (iceenv.frame_budget)
+		iceenv.standard_tables = 1;
+	if (iceenv.standard_tables)
+		iceenv.sampled_tables = 0;
+	// Trellis quantization needs two full passes with optimized tables
+	iceenv.trellis = settings->trellis_quantization && !iceenv.standard_tables;
+	if (iceenv.trellis)
+		iceenv.sampled_tables = 0;
+	// Progressive scans have tables of their own, built from the statistics
+	// of each scan
+	iceenv.progressive = settings->progressive;
+	if (iceenv.progressive)
+	{
+		if (iceenv.frame_budget)
+			return ERR_INVALID_SETTINGS;
+		iceenv.standard_tables = iceenv.sampled_tables = iceenv.trellis = 0;
+	}
+
+	iceenv.input_format = settings->input_format;
+	iceenv.input_red = 0;
+	iceenv.input_blue = 2;
+	switch (settings->input_format)
+	{
+		case ICEJPEG_INPUT_RGB:
+			iceenv.input_bpp = settings->num_components;
+			break;
+		case ICEJPEG_INPUT_BGRA:
+			iceenv.input_red = 2;
+			iceenv.input_blue = 0;
+			// fall through
+		case ICEJPEG_INPUT_RGBA:
+			iceenv.input_bpp = 4;
+			break;
+		case ICEJPEG_INPUT_YUV444:
+		case ICEJPEG_INPUT_I420:
+			iceenv.input_bpp = 1;
+			break;
+		default:
+			return ERR_INVALID_SETTINGS;
+	}
+
+	iceenv.num_components = settings->num_components;
+	iceenv.use_rst_markers = settings->use_rst_markers && !iceenv.progressive;
+	iceenv.restart_setting = settings->restart_interval;
+	iceenv.width = settings->width;
+	iceenv.height = settings->height;
+	iceenv.max_sx = iceenv.max_sy = 0;
+    
+	icecomp[0].sx = settings->sampling_factors[0].sx;
+	icecomp[0].sy = settings->sampling_factors[0].sy;
+	icecomp[1].sx = settings->sampling_factors[1].sx;
+	icecomp[1].sy = settings->sampling_factors[1].sy;
+	icecomp[2].sx = settings->sampling_factors[2].sx;
+	icecomp[2].sy = settings->sampling_factors[2].sy;
+
+	for (i = 0; i < iceenv.num_components; i++)
+	{
+		if (icecomp[i].sx > iceenv.max_sx)
+			iceenv.max_sx = icecomp[i].sx;
+		if (icecomp[i].sy > iceenv.max_sy)
+			iceenv.max_sy = icecomp[i].sy;
+	}
 
-	struct jpeg_dht* cur_src_table = 0;
-	struct jpeg_huffman_code* cur_dst_table = 0;
+	iceenv.mcu_width = iceenv.max_sx << 3;
+	iceenv.mcu_height = iceenv.max_sy << 3;
+	iceenv.num_mcu_x = (iceenv.width + iceenv.mcu_width - 1) / iceenv.mcu_width;
+	iceenv.num_mcu_y = (iceenv.height + iceenv.mcu_height - 1) / iceenv.mcu_height;
+	iceenv.blocks_per_mcu = 0;
+	for (i = 0; i < iceenv.num_components; i++)
+		iceenv.blocks_per_mcu += icecomp[i].sx * icecomp[i].sy;
 
-	// Loop over all 2 tables
-	for (i = 0; i < 3 + 3; i++)
+	for (i = 0; i < iceenv.num_components; i++)
 	{
-		if (i >= 0 && i < 3)
-		{
-			cur_src_table = &icecomp[i].dc_dht;
-		}
-		else
+		icecomp[i].width = (icecomp[i].sx << 3) * iceenv.num_mcu_x; // (width * icecomp[i].sx + iceenv.max_sx - 1) / iceenv.max_sx;
+		icecomp[i].height = iceenv.height; // (height * icecomp[i].sy + iceenv.max_sy - 1) / iceenv.max_sy;
+		icecomp[i].stride = (icecomp[i].sx << 3) * iceenv.num_mcu_x;
+	}
+
+	iceenv.num_workers = min(max(settings->num_threads, 1), ICE_MAX_THREADS);
+	iceenv.workers = (struct jpeg_encode_worker*)calloc(iceenv.num_workers, sizeof(struct jpeg_encode_worker));
+	if (!iceenv.workers)
+		return ERR_OUT_OF_MEMORY;
+	for (i = 0; i < iceenv.num_workers; i++)
+	{
+		iceenv.workers[i].row_acc = (int*)malloc(iceenv.width * sizeof(int));
+		iceenv.workers[i].mcu_blocks = (int16_t*)malloc(iceenv.blocks_per_mcu * 64 * sizeof(int16_t));
+		if (!iceenv.workers[i].row_acc || !iceenv.workers[i].mcu_blocks)
+			return ERR_OUT_OF_MEMORY;
+		if (settings->block_cache)
 		{
-			cur_src_table = &icecomp[i - 3].ac_dht;
+			iceenv.workers[i].block_cache = (struct jpeg_block_cache_entry*)calloc(BLOCK_CACHE_SIZE, sizeof(struct jpeg_block_cache_entry));
+			if (!iceenv.workers[i].block_cache)
+				return ERR_OUT_OF_MEMORY;
 		}
+	}
+	choose_restart_interval();
+	iceenv.num_quant_tables = 2;
 
-		if (!cur_src_table)
-			continue;
+	if (iceenv.progressive)
+	{
+		int err = setup_scans(settings->scan_script, settings->num_scans);
+		if (err)
+			return err;
+	}
 
-		word cur_bitstring = 0;
-		byte cur_length = 0;
+//    for (i = 0; i < 64; i++)
+//    {
+//        jpeg_qtbl_luminance[i] /= 2;
+//        jpeg_qtbl_chrominance[i] /= 2;
+//    }
+    
+	icejpeg_setquality(settings->quality);
 
-		if (i >= 0 && i < 3)
-		{
-			cur_dst_table = iceenv.dc_huff[i];
-		}
-		else
-		{
-			cur_dst_table = iceenv.ac_huff[i - 3];
-		}
+	return ERR_OK;
+}
 
-		byte *symbols = cur_src_table->codes;
+// Takes over planar YCbCr input. If every plane already has the resolution
+// of its component, the component planes are filled directly. Otherwise the
+// planes are interleaved like color converted input and downsampled later.
+static int read_planar_input(const byte *image)
+{
+	int i;
+	int direct = 1;
+	size_t offset = 0;
 
-		// Loop over all 16 code lengths
-		for (j = 0; j < 16; j++)
+	for (i = 0; i < iceenv.num_components; i++)
+	{
+		int step_x = iceenv.max_sx / icecomp[i].sx;
+		int step_y = iceenv.max_sy / icecomp[i].sy;
+		iceenv.input_plane_width[i] = iceenv.width;
+		iceenv.input_plane_height[i] = iceenv.height;
+		if (i && iceenv.input_format == ICEJPEG_INPUT_I420)
 		{
-			cur_length = j + 1;
+			iceenv.input_plane_width[i] = (iceenv.width + 1) >> 1;
+			iceenv.input_plane_height[i] = (iceenv.height + 1) >> 1;
+		}
+		iceenv.input_planes[i] = image + offset;
+		offset += (size_t)iceenv.input_plane_width[i] * iceenv.input_plane_height[i];
 
-#ifdef _JPEG_ENCODER_DEBUG
-			printf("Codes of length %d bits:\n", cur_length);
-#endif
-			// Loop over all codes of length j
-			for (k = 0; k < cur_src_table->num_codes[j]; k++)
-			{
-				cur_dst_table[*symbols].length = cur_length;
-				cur_dst_table[*symbols].code = cur_bitstring;
+		if (iceenv.input_plane_width[i] != (iceenv.width + step_x - 1) / step_x ||
+			iceenv.input_plane_height[i] != (iceenv.height + step_y - 1) / step_y)
+			direct = 0;
+	}
 
-#ifdef _JPEG_ENCODER_DEBUG
-				printf("\t");
-				int l;
-				for (l = cur_length - 1; l >= 0; l--)
-				{
-					printf("%d", (cur_bitstring & (1 << l)) >> l);
-				}
-				printf(" -> %X\n", *symbols);
-#endif
+	if (direct)
+	{
+		int err = downsample();
+		iceenv.planes_ready = !err;
+		memset(iceenv.input_planes, 0, sizeof(iceenv.input_planes));
+		return err;
+	}
 
-				symbols++;
-				cur_bitstring++;
+	iceenv.image_rows = iceenv.height;
+	iceenv.image = (int16_t*)malloc(iceenv.width * iceenv.height * iceenv.num_components * sizeof(int16_t));
+	if (!iceenv.image)
+		return ERR_OUT_OF_MEMORY;
 
-			}
-			cur_bitstring <<= 1;
-		}
-#ifdef _JPEG_ENCODER_DEBUG
-		printf("\n");
-#endif
-	}
+	ice_run_parallel(convert_job, iceenv.workers, sizeof(struct jpeg_encode_worker), split_work(iceenv.height));
+	memset(iceenv.input_planes, 0, sizeof(iceenv.input_planes));
 
 	return ERR_OK;
 }
 
-static inline int advance_scan_buffer(void)
+int icejpeg_encode_init(char *filename, unsigned char *image, struct jpeg_encoder_settings *settings)
 {
-    iceenv.buf_pos++;
+	int err = setup_encoder(filename, settings);
+	if (err)
+		return err;
+
+	if (iceenv.standard_tables)
+	{
+		iceenv.single_pass = 1;
+		err = use_standard_huffman_tables();
+		if (err)
+			return err;
+	}
+
+	if (iceenv.input_format == ICEJPEG_INPUT_YUV444 || iceenv.input_format == ICEJPEG_INPUT_I420)
+		return read_planar_input(image);
+
+	iceenv.image_rows = iceenv.height;
+	iceenv.image = (int16_t*)malloc(iceenv.width * iceenv.height * iceenv.num_components * sizeof(int16_t));
+	if (!iceenv.image)
+		return ERR_OUT_OF_MEMORY;
+    
+    return convert_to_ycbcbr(image);
     
-    if (iceenv.buf_pos >= iceenv.scan_buf_size)
-    {
-        iceenv.scan_buffer = (byte*) realloc(iceenv.scan_buffer, iceenv.scan_buf_size + 0xFFFF);
-		if (!iceenv.scan_buffer)
-			return ERR_OUT_OF_MEMORY;
-		memset(iceenv.scan_buffer + iceenv.scan_buf_size, 0, 0xFFFF);
-        iceenv.scan_buf_size += 0xFFFF;
-    }
-    return ERR_OK;
 }
 
-// Writes a bit string of a give length to the bit stream
-static inline int write_bits(unsigned short value, unsigned char length)
+/*!
+* \brief
+* [icejpeg_encode_init_coefficients]
+*
+* Prepares encoding quantized DCT coefficients, e.g. those returned by
+* icejpeg_read_coefficients(), with icejpeg_write(). Color conversion,
+* downsampling, the DCT and quantization are skipped; the quantization
+* tables are written as given. Size, number of components and sampling
+* factors are taken from coefficients, quality and input_format are
+* ignored; target_size, frame_budget and trellis_quantization would
+* change the coefficients and aren't allowed. The planes must stay valid
+* until the image has been written.
+*/
+int icejpeg_encode_init_coefficients(char *filename, const struct jpeg_coefficients *coefficients, struct jpeg_encoder_settings *settings)
 {
-    if (length == 0xFF)
-        return ERR_OK;
-    
-	if (length > 16)
-		return ERR_INVALID_LENGTH;
-
-	while (length)
-	{
-		unsigned char bits_from_byte = min(length, iceenv.bits_remaining);
-		// The right-shift aligns bit strings longer than what our current byte can hold
-		// The left-shift aligns bit strings shorter than what our current byte can hold
-		iceenv.scan_buffer[iceenv.buf_pos] |= (value >> max(0, length - iceenv.bits_remaining)) << max(0, iceenv.bits_remaining - length);
-		iceenv.bits_remaining -= bits_from_byte;
-		length -= bits_from_byte;
-		if (!iceenv.bits_remaining)
+	struct jpeg_encoder_settings s = *settings;
+	int i, j, err;
+
+	if (settings->target_size || settings->frame_budget || settings->trellis_quantization ||
+		coefficients->metadata_size < 0 || (coefficients->metadata_size && !coefficients->metadata))
+		return ERR_INVALID_SETTINGS;
+
+	s.width = coefficients->width;
+	s.height = coefficients->height;
+	s.num_components = coefficients->num_components;
+	s.input_format = ICEJPEG_INPUT_RGB;
+	// The tables come with the coefficients, quality only has to be valid
+	s.quality = 50;
+	for (i = 0; i < coefficients->num_components && i < 3; i++)
+	{
+		if (coefficients->planes[i].sx < 1 || coefficients->planes[i].sy < 1)
+			return ERR_INVALID_SAMPLING_FACTOR;
+		s.sampling_factors[i].sx = coefficients->planes[i].sx;
+		s.sampling_factors[i].sy = coefficients->planes[i].sy;
+	}
+
+	err = setup_encoder(filename, &s);
+	if (err)
+		return err;
+
+	for (i = 0; i < iceenv.num_components; i++)
+	{
+		const struct jpeg_coefficient_plane *plane = &coefficients->planes[i];
+		if (!plane->coefs || plane->blocks_x < iceenv.num_mcu_x * icecomp[i].sx ||
+			plane->blocks_y < iceenv.num_mcu_y * icecomp[i].sy)
+			return ERR_INVALID_SETTINGS;
+		for (j = 0; j < 64; j++)
 		{
-			iceenv.bits_remaining = 8;
-			// Insert stuff byte if necessary
-			if (iceenv.scan_buffer[iceenv.buf_pos] == 0xFF)
-                advance_scan_buffer();
-            advance_scan_buffer();
+			if (!plane->quant_table[j])
+				return ERR_INVALID_SETTINGS;
+			iceenv.quant_factor[i][j] = plane->quant_table[j];
 		}
 	}
+	if (iceenv.num_components == 1)
+		iceenv.num_quant_tables = 1;
+	else if (memcmp(iceenv.quant_factor[1], iceenv.quant_factor[2], sizeof(iceenv.quant_factor[1])))
+		iceenv.num_quant_tables = 3;
+	iceenv.input_coefs = coefficients;
+	// Nothing to downsample, transform_mcu() copies the blocks
+	iceenv.planes_ready = 1;
+
+	if (iceenv.standard_tables)
+	{
+		iceenv.single_pass = 1;
+		return use_standard_huffman_tables();
+	}
 
 	return ERR_OK;
 }
 
-inline static void fill_current_byte(void)
+void icejpeg_setquality(unsigned char quality)
 {
-    if (iceenv.bits_remaining < 8)
+    // Coefficient input comes with its own tables
+    if (iceenv.input_coefs)
+        return;
+
+    if (quality >= 0 && quality <= 100)
+        iceenv.quality = quality;
+    else
+        return;
+    
+    iceenv.quality_scale_factor = iceenv.quality < 50 ? 5000 / iceenv.quality : 200 - 2 * iceenv.quality;
+
+    // Quantization factors of each component in natural order, and the
+    // divisors used after the fast DCT, which include its scale factors
+    int i, j;
+    for (i = 0; i < 3; i++)
     {
-        write_bits((1 << iceenv.bits_remaining) - 1, iceenv.bits_remaining);
+        int min_ac = 255;
+        for (j = 0; j < 64; j++)
+        {
+            iceenv.quant_factor[i][j] = CLAMPQNT((iceenv.quality_scale_factor * jpeg_qtbl_selector[i][j] + 50) / 100);
+            iceenv.fast_divisor[i][j] = max((iceenv.quant_factor[i][j] * fdct_fast_scales[j] + (1 << 10)) >> 11, 1);
+            if (j)
+                min_ac = min(min_ac, iceenv.quant_factor[i][j]);
+        }
+        // An AC coefficient below half the quantization step becomes 0.
+        // The margin covers the rounding errors of the integer DCTs, with
+        // the finest steps only blocks without any deviation are flat.
+        iceenv.flat_limit[i] = max((min_ac << 1) - 4, 1);
     }
+
+    // Cached blocks were quantized with the old tables
+    reset_block_caches();
 }
 
-inline static void write_rst_marker(void)
+void icejpeg_set_restart_markers(int userst)
 {
-    fill_current_byte();
-    iceenv.scan_buffer[iceenv.buf_pos] = 0xFF;
-    advance_scan_buffer();
-    iceenv.scan_buffer[iceenv.buf_pos] = 0xD0 | iceenv.cur_rst_marker;
-    advance_scan_buffer();
-    iceenv.cur_rst_marker = (iceenv.cur_rst_marker + 1) & 7;
+    iceenv.use_rst_markers = userst;
+    choose_restart_interval();
 }
 
-static int create_bitstream()
+#ifdef _JPEG_ENCODER_STATS
+void icejpeg_get_stats(struct jpeg_encoder_stats** stats)
 {
-	int i;
-    
-    iceenv.scan_buf_size = 0xFFFF;
-    iceenv.scan_buffer = (byte*) malloc(iceenv.scan_buf_size);
-	memset(iceenv.scan_buffer, 0, 0xFFFF);
-    
-	iceenv.cur_mcu_x = iceenv.cur_mcu_y = 0;
-	iceenv.rst_interval_counter = 0;
-	for (i = 0; i < iceenv.num_components; i++)
-		icecomp[i].rlc_index = 0;
-	// Encode every MCU
-	for (;;)
-	{
-		for (i = 0; i < iceenv.num_components; i++)
-		{
-			struct jpeg_encode_component *c = &icecomp[i];
-			int is_dc = 1;
-			int du_index = 0;
-			int num_du_per_mcu = c->sx * c->sy;
-			struct jpeg_huffman_code *huff_table = 0;
-			int err;
-			struct jpeg_zrlc* cur_rlc;
-            
-            int start_index = icecomp[i].rlc_index;
-
-			while (num_du_per_mcu)
-			{
-				huff_table = is_dc ? iceenv.dc_huff[i] : iceenv.ac_huff[i];
-				cur_rlc = c->rlc[icecomp[i].rlc_index];
-
-				if (is_dc) is_dc = 0;
-
-				if (!huff_table[cur_rlc->info].length)
-					return ERR_NO_HUFFMAN_CODE_FOR_SYMBOL;
-
-				err = write_bits(huff_table[cur_rlc->info].code, huff_table[cur_rlc->info].length);
-				if (err)
-					return err;
-				err = write_bits(cur_rlc->value.bits, cur_rlc->value.length);
-				if (err)
-					return err;
-               
-#ifdef _JPEG_ENCODER_DEBUG
-                //if (iceenv.cur_mcu_y == 10 && iceenv.cur_mcu_x == 0)
-                //    printf("Wrote code (%d,%d), category %d, bits %d\n", (cur_rlc->info & 0xF0) >> 4, cur_rlc->info & 0xF, cur_rlc->value.length, cur_rlc->value.bits);
+    *stats = &icestats;
+}
 #endif
-                
-				du_index += UPR4(cur_rlc->info);
-				du_index++;
-				// Reset index if we've processed all 64 samples OR encountered an EOB
-				if (du_index == 64 || cur_rlc->value.length == 0xFF)
-				{
-                    // printf("Done writing (%d,%d) (%d)\n", mcu_x, mcu_y, i);
-					du_index = 0;
-					is_dc = 1;
-					num_du_per_mcu--;
-                    start_index = icecomp[i].rlc_index;
-                }
-
-				icecomp[i].rlc_index++;
-			}
 
-// #ifdef _JPEG_ENCODER_DEBUG
-// 			if (icecomp[i].rlc_index != icecomp[i].rlc_indices[iceenv.cur_mcu_y][iceenv.cur_mcu_x])
-// 				printf("DIFFERENT!\n");
-// #endif
-		}
-		//break;
-		iceenv.cur_mcu_x++;
-		if (iceenv.cur_mcu_x == iceenv.num_mcu_x)
-		{
-			iceenv.cur_mcu_x = 0;
-			iceenv.cur_mcu_y++;
-			if (iceenv.cur_mcu_y == iceenv.num_mcu_y)
-				break;
-		}
+// Codes the downsampled image at the current quality and writes the file
+static int write_image(void)
+{
+	int err;
 
-		if (iceenv.use_rst_markers)
+	iceenv.single_pass = iceenv.standard_tables;
+	if (!iceenv.single_pass && !iceenv.progressive)
+	{
+		// With sampled statistics the image is coded in a single pass
+		// once the tables are known
+		err = iceenv.sampled_tables ? sample_code_stats() : encode();
+		if (err)
+			return err;
+		build_optimized_tables();
+		if (iceenv.trellis)
 		{
-			iceenv.rst_interval_counter++;
-			if (iceenv.rst_interval_counter == iceenv.restart_interval)
-			{
-				write_rst_marker();
-				iceenv.rst_interval_counter = 0;
-			}
+			err = trellis_pass();
+			if (err)
+				return err;
 		}
+		iceenv.single_pass = iceenv.sampled_tables;
 	}
 
-#ifdef _JPEG_ENCODER_DEBUG
-	printf("Finished bitstream at %d bytes\n", iceenv.buf_pos);
-#endif
-
-#ifdef _JPEG_ENCODER_STATS
-	icestats.bits_per_pixel = (float)((iceenv.buf_pos * 8) + (8 - iceenv.bits_remaining)) / (float)(iceenv.width * iceenv.height);
-	icestats.compression_ratio = icestats.bits_per_pixel / 8.0f;
-#endif
-    
-    fill_current_byte();
+	// The headers can go out before the scan is coded, which passes on
+	// each restart interval as soon as it is done
+	err = write_headers();
+	if (!err)
+	{
+		if (iceenv.frame_budget)
+			err = encode_rate_controlled();
+		else if (iceenv.progressive)
+			err = encode_progressive();
+		else
+			err = iceenv.single_pass ? encode_single_pass() : create_bitstream();
+	}
+	if (!err)
+		err = write_trailer();
+	else
+		sink_close();
     
-	icestats.scan_segment_size = iceenv.buf_pos;
-
-	return ERR_OK;
+	return err;
 }
 
-static int encode(void)
+int icejpeg_write(void)
 {
-    int i, sx, sy;
-
-	for (i = 0; i < iceenv.num_components; i++)
+	int err = downsample();
+	if (err)
+		return err;
+	if (iceenv.target_size)
 	{
-		icecomp[i].rlc = (struct jpeg_zrlc**) malloc(sizeof(struct jpeg_zrlc*) * 0xFFFF);
-		memset(icecomp[i].rlc, 0, sizeof(struct jpeg_zrlc*) * 0xFFFF);
-        icecomp[i].rlc_size = 0xFFFF;
+		err = choose_quality();
+		if (err)
+			return err;
 	}
 
-    // Encode every MCU
-    for (;;)
-    {
-        for (i = 0; i < iceenv.num_components; i++)
-        {
-            for (sy = 0; sy < icecomp[i].sy; sy++)
-            {
-                for (sx = 0; sx < icecomp[i].sx; sx++)
-                {
-                    // Encode single DU
-                    
-                    encode_du(i, sx, sy);
-
-                }
-            }
-            //icecomp[i].rlc_indices[iceenv.cur_mcu_y][iceenv.cur_mcu_x] = icecomp[i].rlc_index;
-        }
+	return write_image();
+}
 
-		iceenv.cur_mcu_x++;
-		if (iceenv.cur_mcu_x == iceenv.num_mcu_x)
-		{
-			iceenv.cur_mcu_x = 0;
-			iceenv.cur_mcu_y++;
-			if (iceenv.cur_mcu_y == iceenv.num_mcu_y)
-				break;
-		}
+/*!
+* \brief
+* [icejpeg_write_qualities]
+*
+* Encodes the image once for every quality in qualities, the output of
+* quality i goes to memory as with icejpeg_set_output_memory(): buffers[i]
+* has to be free()d by the caller, also if an error occurs, sizes[i] is the
+* size of the data. Color conversion, downsampling and the DCT are only
+* done once; quantization and coding are done for each quality in turn,
+* using all threads. Replaces icejpeg_write(), target_size is ignored.
+*/
+int icejpeg_write_qualities(const unsigned char *qualities, int num_qualities, unsigned char **buffers, int *sizes)
+{
+	int i, err;
 
-		// Count MCUs if restart markers are used
-		// If a marker must be written, reset DC prediction as well
-        if (iceenv.use_rst_markers)
-        {
-            iceenv.rst_interval_counter++;
-            if (iceenv.rst_interval_counter == iceenv.restart_interval)
-            {
-                for (i = 0; i < iceenv.num_components; i++)
-                    icecomp[i].prev_dc = 0;
-                iceenv.rst_interval_counter = 0;
-            }
-        }
+	for (i = 0; i < num_qualities; i++)
+	{
+		buffers[i] = 0;
+		sizes[i] = 0;
+		if (qualities[i] < 1 || qualities[i] > 100)
+			return ERR_INVALID_SETTINGS;
+	}
+	if (iceenv.input_coefs)
+		return ERR_INVALID_SETTINGS;
 
-    }
+	err = downsample();
+	if (!err)
+		err = keep_dct_output();
 
-	for (i = 0; i < iceenv.num_components; i++)
+	for (i = 0; i < num_qualities && !err; i++)
 	{
-		icecomp[i].rlc_count = icecomp[i].rlc_index;
+		icejpeg_setquality(qualities[i]);
+		icejpeg_set_output_memory(&buffers[i], &sizes[i]);
+		err = write_image();
 	}
-    
-    return ERR_OK;
+
+	return err;
 }
 
-int convert_to_ycbcbr(byte *image)
+//************************************************************
+// INCREMENTAL ENCODING
+//************************************************************
+
+// Standard Huffman tables from Annex K.3 of the JPEG standard. As the
+// symbol statistics aren't known in advance when encoding incrementally,
+// these are used instead of optimized tables.
+static const byte jpeg_std_dc_luminance_bits[] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const byte jpeg_std_dc_chrominance_bits[] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const byte jpeg_std_dc_values[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const byte jpeg_std_ac_luminance_bits[] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D };
+static const byte jpeg_std_ac_luminance_values[] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+	0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+	0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+	0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+	0xF9, 0xFA
+};
+
+static const byte jpeg_std_ac_chrominance_bits[] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const byte jpeg_std_ac_chrominance_values[] = {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+	0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+	0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+	0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+	0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+	0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+	0xF9, 0xFA
+};
+
+static int copy_dht(struct jpeg_dht *dht, const byte *bits, const byte *values, int *numcodes)
 {
-    // Copy image to our buffer and perform RGB->YCbCr conversion
-    int x, y;
-    int *cur_image = iceenv.image;
-    for (y = 0; y < iceenv.height; y++)
+    int i;
+    *numcodes = 0;
+    for (i = 0; i < 16; i++)
     {
-        for (x = 0; x < iceenv.width; x++)
-        {
-            if (iceenv.num_components == 3)
-            {
-                register int y = DESCALE(YR * image[0] + YG * image[1] + YB * image[2]);
-                register int cb = DESCALE(CBR * image[0] + CBG * image[1] + CBB * image[2]) + 128;
-                register int cr = DESCALE(CRR * image[0] + CRG * image[1] + CRB * image[2]) + 128;
-                
-                *cur_image++ = y;
-                *cur_image++ = cb;
-                *cur_image++ = cr;
-                image += 3;
-            }
-            else
-            {
-                register int y = DESCALE(YR * image[0] + YG * image[0] + YB * image[0]);
-                
-                *cur_image++ = y;
-                image++;
-            }
-        }
+        dht->num_codes[i] = bits[i];
+        *numcodes += bits[i];
     }
-    
+    dht->codes = (byte*) malloc(*numcodes);
+    if (!dht->codes)
+        return ERR_OUT_OF_MEMORY;
+    memcpy(dht->codes, values, *numcodes);
     return ERR_OK;
 }
 
-int icejpeg_encode_init(char *filename, unsigned char *image, struct jpeg_encoder_settings *settings)
+// Sets up the standard luminance tables for the first component and
+// the standard chrominance tables for the others
+static int use_standard_huffman_tables(void)
 {
-	memset(&iceenv, 0, sizeof(struct __ice_env));
-	memset(icecomp, 0, sizeof(struct jpeg_encode_component) * 3);
-
-	strcpy(iceenv.outfile, filename);
-	if (settings->num_components != 1 && settings->num_components != 3)
-	{
-		return ERR_INVALID_NUMBER_OF_COMP;
-	}
-
-    int i = 0;
-    for (; i < settings->num_components; i++)
+    int i;
+    for (i = 0; i < iceenv.num_components; i++)
     {
-        if (settings->sampling_factors[i].sx > 4 ||
-            settings->sampling_factors[i].sx & (settings->sampling_factors[i].sx - 1))
-            return ERR_INVALID_SAMPLING_FACTOR;
-
-        if (settings->sampling_factors[i].sy > 4 ||
-            settings->sampling_factors[i].sy & (settings->sampling_factors[i].sy - 1))
-            return ERR_INVALID_SAMPLING_FACTOR;
+        if (copy_dht(&icecomp[i].dc_dht, !i ? jpeg_std_dc_luminance_bits : jpeg_std_dc_chrominance_bits,
+                     jpeg_std_dc_values, &iceenv.dc_huff_numcodes[i]))
+            return ERR_OUT_OF_MEMORY;
+        if (copy_dht(&icecomp[i].ac_dht, !i ? jpeg_std_ac_luminance_bits : jpeg_std_ac_chrominance_bits,
+                     !i ? jpeg_std_ac_luminance_values : jpeg_std_ac_chrominance_values, &iceenv.ac_huff_numcodes[i]))
+            return ERR_OUT_OF_MEMORY;
     }
-    
-	iceenv.num_components = settings->num_components;
-	iceenv.use_rst_markers = settings->use_rst_markers;
-	iceenv.width = settings->width;
-	iceenv.height = settings->height;
-	iceenv.max_sx = iceenv.max_sy = 0;
-	iceenv.image = (int *)malloc(iceenv.width * iceenv.height * iceenv.num_components * sizeof(int));
+    return gen_huffman_tables();
+}
+
+/*!
+* \brief
+* [icejpeg_encode_begin]
+*
+* Starts encoding an image that is handed over row by row via
+* icejpeg_encode_write_rows(). Only a single MCU row of the image is
+* buffered. Each MCU row is encoded and handed to the output as soon as it
+* is complete, using the standard Huffman tables.
+* filename may be 0 if one of the icejpeg_set_output_*() functions is
+* called before the first row is written.
+*/
+int icejpeg_encode_begin(char *filename, struct jpeg_encoder_settings *settings)
+{
+	struct jpeg_encode_worker *w;
+	int i, err;
+
+	err = setup_encoder(filename, settings);
+	if (err)
+		return err;
+
+	// Planar input can't be delivered row by row, and the quality for a
+	// target size, the quantization for a frame budget and the tables of
+	// progressive scans can only be found with the whole image at hand
+	if (iceenv.input_format == ICEJPEG_INPUT_YUV444 || iceenv.input_format == ICEJPEG_INPUT_I420 ||
+		iceenv.target_size || iceenv.frame_budget || iceenv.progressive)
+		return ERR_INVALID_SETTINGS;
+
+	iceenv.single_pass = 1;
+	iceenv.sampled_tables = 0;
+	iceenv.incremental = 1;
+
+	// The vertical filter needs up to max_sy rows in front of the current
+	// MCU row because of the centering offset, the triangle filter also some
+	// behind it
+	iceenv.image_rows = iceenv.mcu_height + (iceenv.max_sy << 1);
+	iceenv.image = (int16_t*)malloc(iceenv.width * iceenv.image_rows * iceenv.num_components * sizeof(int16_t));
 	if (!iceenv.image)
 		return ERR_OUT_OF_MEMORY;
-    
-	icecomp[0].sx = settings->sampling_factors[0].sx;
-	icecomp[0].sy = settings->sampling_factors[0].sy;
-	icecomp[1].sx = settings->sampling_factors[1].sx;
-	icecomp[1].sy = settings->sampling_factors[1].sy;
-	icecomp[2].sx = settings->sampling_factors[2].sx;
-	icecomp[2].sy = settings->sampling_factors[2].sy;
 
 	for (i = 0; i < iceenv.num_components; i++)
 	{
-		if (icecomp[i].sx > iceenv.max_sx)
-			iceenv.max_sx = icecomp[i].sx;
-		if (icecomp[i].sy > iceenv.max_sy)
-			iceenv.max_sy = icecomp[i].sy;
+		icecomp[i].pixels = (int16_t*)malloc(icecomp[i].stride * (icecomp[i].sy << 3) * sizeof(int16_t));
+		if (!icecomp[i].pixels)
+			return ERR_OUT_OF_MEMORY;
 	}
 
-	iceenv.mcu_width = iceenv.max_sx << 3;
-	iceenv.mcu_height = iceenv.max_sy << 3;
-	iceenv.num_mcu_x = (iceenv.width + iceenv.mcu_width - 1) / iceenv.mcu_width;
-	iceenv.num_mcu_y = (iceenv.height + iceenv.mcu_height - 1) / iceenv.mcu_height;
-	iceenv.restart_interval = iceenv.num_mcu_x;
+	// Only the first worker is used
+	w = &iceenv.workers[0];
+	w->writer.size = 0xFFFF;
+	w->writer.buffer = (byte*) malloc(w->writer.size);
+	if (!w->writer.buffer)
+		return ERR_OUT_OF_MEMORY;
 
-	for (i = 0; i < iceenv.num_components; i++)
-	{
-		icecomp[i].width = (icecomp[i].sx << 3) * iceenv.num_mcu_x; // (width * icecomp[i].sx + iceenv.max_sx - 1) / iceenv.max_sx;
-		icecomp[i].height = iceenv.height; // (height * icecomp[i].sy + iceenv.max_sy - 1) / iceenv.max_sy;
-		icecomp[i].stride = (icecomp[i].sx << 3) * iceenv.num_mcu_x;
+	err = use_standard_huffman_tables();
+	if (err)
+		return err;
 
-															 
-		//icecomp[i].pixels = (byte *)malloc(icecomp[i].stride * icecomp[i].height);
-	}
+	for (i = 0; i < iceenv.num_workers; i++)
+		reset_color_extrema(&iceenv.workers[i]);
 
-	iceenv.bits_remaining = 8;
-    
-//    for (i = 0; i < 64; i++)
-//    {
-//        jpeg_qtbl_luminance[i] /= 2;
-//        jpeg_qtbl_chrominance[i] /= 2;
-//    }
-    
-	icejpeg_setquality(settings->quality);
-    
-    return convert_to_ycbcbr(image);
-    
+	return ERR_OK;
 }
 
-void icejpeg_setquality(unsigned char quality)
+/*!
+* \brief
+* [icejpeg_encode_write_rows]
+*
+* Hands the next num_rows rows of the image to the encoder, in the same
+* format icejpeg_encode_init() expects for the whole image.
+*/
+int icejpeg_encode_write_rows(const unsigned char *rows, int num_rows)
 {
-    if (quality >= 0 && quality <= 100)
-        iceenv.quality = quality;
-    else
-        return;
-    
-    iceenv.quality_scale_factor = iceenv.quality < 50 ? 5000 / iceenv.quality : 200 - 2 * iceenv.quality;
-}
+	struct jpeg_encode_worker *w = &iceenv.workers[0];
+	// Rows below the MCU row the triangle filter looks at
+	int lookahead = iceenv.chroma_filter == ICEJPEG_FILTER_TRIANGLE ? iceenv.max_sy >> 1 : 0;
+	int i, err;
 
-void icejpeg_set_restart_markers(int userst)
-{
-    iceenv.use_rst_markers = userst;
-    iceenv.restart_interval = iceenv.num_mcu_x;
-}
+	if (!iceenv.incremental)
+		return ERR_ENCODE_NOT_BEGUN;
+	if (iceenv.rows_received + num_rows > iceenv.height)
+		return ERR_INVALID_NUMBER_OF_ROWS;
 
-#ifdef _JPEG_ENCODER_STATS
-void icejpeg_get_stats(struct jpeg_encoder_stats** stats)
-{
-    *stats = &icestats;
+	if (!iceenv.headers_written)
+	{
+		err = write_headers();
+		if (err)
+			return err;
+	}
+
+	while (num_rows--)
+	{
+		convert_row(rows, source_row(iceenv.rows_received));
+		rows += iceenv.width * iceenv.input_bpp;
+		iceenv.rows_received++;
+
+		// Encode the current MCU row as soon as all of its rows have arrived
+		while (iceenv.cur_mcu_y < iceenv.num_mcu_y &&
+			   iceenv.rows_received >= min((iceenv.cur_mcu_y + 1) * iceenv.mcu_height + lookahead, iceenv.height))
+		{
+			for (i = 0; i < iceenv.num_components; i++)
+				downsample_rows(w, i, iceenv.cur_mcu_y * (icecomp[i].sy << 3), icecomp[i].sy << 3, icecomp[i].pixels);
+
+			err = encode_mcus(w, iceenv.cur_mcu_y * iceenv.num_mcu_x, (iceenv.cur_mcu_y + 1) * iceenv.num_mcu_x, iceenv.cur_mcu_y);
+			if (err)
+				return err;
+			err = flush_scan_buffer(&w->writer);
+			if (err)
+				return err;
+
+			iceenv.cur_mcu_y++;
+		}
+	}
+
+	return ERR_OK;
 }
-#endif
 
-int icejpeg_write(void)
+/*!
+* \brief
+* [icejpeg_encode_finish]
+*
+* Finishes the scan and closes the output. All rows of the
+* image must have been written.
+*/
+int icejpeg_encode_finish(void)
 {
-	downsample();
-    encode();
-	find_code_lengths();
-	limit_code_lengths();
-	sort_codes();
-    gen_DHT();
-	gen_huffman_tables();
-	int err = create_bitstream();
+	int err;
 
-    write_to_file();
-    
-	return err;
+	if (!iceenv.incremental)
+		return ERR_ENCODE_NOT_BEGUN;
+	// The headers go out with the first rows
+	if (iceenv.rows_received != iceenv.height || !iceenv.headers_written)
+		return ERR_INVALID_NUMBER_OF_ROWS;
+
+	merge_color_extrema();
+	err = finish_single_pass_scan();
+	if (err)
+		return err;
+
+	return write_trailer();
 }
 
 /*!
@@ -1317,22 +3964,62 @@ void icejpeg_encode_cleanup()
 		iceenv.image = 0;
 	}
 
-    if (iceenv.scan_buffer)
-    {
-        free(iceenv.scan_buffer);
-        iceenv.scan_buf_size = 0;
-    }
-    
-	for (i = 0; i < iceenv.num_components; i++)
+	free(iceenv.dct_blocks);
+	iceenv.dct_blocks = 0;
+
+	free(iceenv.rc_interval_bits);
+	free(iceenv.rc_interval_levels);
+	iceenv.rc_interval_bits = 0;
+	iceenv.rc_interval_levels = 0;
+
+	free(iceenv.coef_blocks);
+	free(iceenv.scans);
+	iceenv.coef_blocks = 0;
+	iceenv.scans = 0;
+#ifdef _JPEG_ENCODER_STATS
+	icestats.num_intervals = 0;
+	icestats.interval_bits = 0;
+	icestats.interval_levels = 0;
+#endif
+
+
+	if (iceenv.sink.file)
+	{
+		fclose(iceenv.sink.file);
+		iceenv.sink.file = 0;
+	}
+
+	if (iceenv.sink.filename)
+	{
+		free(iceenv.sink.filename);
+		iceenv.sink.filename = 0;
+	}
+
+	if (iceenv.sink.pending)
+	{
+		free(iceenv.sink.pending);
+		iceenv.sink.pending = 0;
+	}
+
+	if (iceenv.workers)
 	{
-        j = 0;
-        while (j < icecomp[j].rlc_index)
-            free(icecomp[i].rlc[j++]);
-		if (icecomp[i].rlc)
+		for (i = 0; i < iceenv.num_workers; i++)
 		{
-			free(icecomp[i].rlc);
-			icecomp[i].rlc = 0;
+			struct jpeg_encode_worker *w = &iceenv.workers[i];
+			free(w->row_acc);
+			free(w->mcu_blocks);
+			free(w->block_cache);
+			free(w->writer.buffer);
+			for (j = 0; j < 3; j++)
+				free(w->rlc[j]);
 		}
+		free(iceenv.workers);
+		iceenv.workers = 0;
+		iceenv.num_workers = 0;
+	}
+    
+	for (i = 0; i < iceenv.num_components; i++)
+	{
 		if (icecomp[i].dc_dht.codes)
 		{
 			free(icecomp[i].dc_dht.codes);
@@ -1346,10 +4033,188 @@ void icejpeg_encode_cleanup()
     }
 }
 
+//************************************************************
+// OUTPUT SINKS
+//************************************************************
+
+static int sink_open(void)
+{
+    struct jpeg_output_sink *sink = &iceenv.sink;
+
+    sink->bytes_written = 0;
+    sink->error = ERR_OK;
+
+    switch (sink->type)
+    {
+        case SINK_FILE:
+            if (!sink->filename)
+                return ERR_CANNOT_OPEN_OUTPUT_FILE;
+            sink->file = fopen(sink->filename, "wb");
+            if (!sink->file)
+                return ERR_CANNOT_OPEN_OUTPUT_FILE;
+            break;
+        case SINK_MEMORY:
+            sink->data = 0;
+            sink->capacity = 0;
+            break;
+    }
+
+    if (sink->size)
+        *sink->size = 0;
+
+    return ERR_OK;
+}
+
+// Appends count items of the given size to the output. Errors are sticky
+// and returned by the next sink_flush()/sink_close() as well.
+static int sink_write(const void *data, int size, int count)
+{
+    struct jpeg_output_sink *sink = &iceenv.sink;
+    int length = size * count;
+
+    if (sink->error || !length)
+        return sink->error;
+
+    switch (sink->type)
+    {
+        case SINK_FILE:
+            if (fwrite(data, size, count, sink->file) != (size_t)count)
+                sink->error = ERR_CANNOT_OPEN_OUTPUT_FILE;
+            break;
+        case SINK_MEMORY:
+            if (sink->bytes_written + length > sink->capacity)
+            {
+                int new_capacity = max(sink->capacity * 2, max(sink->bytes_written + length, 0xFFFF));
+                byte *new_data = (byte*) realloc(sink->data, new_capacity);
+                if (!new_data)
+                {
+                    sink->error = ERR_OUT_OF_MEMORY;
+                    break;
+                }
+                sink->data = new_data;
+                sink->capacity = new_capacity;
+                *sink->buffer = new_data;
+            }
+            memcpy(sink->data + sink->bytes_written, data, length);
+            break;
+        case SINK_BUFFER:
+            if (sink->bytes_written + length > sink->capacity)
+            {
+                sink->error = ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            }
+            memcpy(sink->data + sink->bytes_written, data, length);
+            break;
+        case SINK_CALLBACK:
+            if (sink->pending_size + length > sink->pending_capacity)
+            {
+                // Large writes (scan data) go to the callback directly
+                if (sink_flush())
+                    break;
+                if (length > sink->pending_capacity)
+                {
+                    if (sink->callback(sink->user, (const unsigned char*)data, length))
+                        sink->error = ERR_WRITE_CALLBACK_FAILED;
+                    break;
+                }
+            }
+            memcpy(sink->pending + sink->pending_size, data, length);
+            sink->pending_size += length;
+            break;
+    }
+
+    if (!sink->error)
+    {
+        sink->bytes_written += length;
+        if (sink->size)
+            *sink->size = sink->bytes_written;
+    }
+
+    return sink->error;
+}
+
+static inline int sink_write_byte(byte b)
+{
+    return sink_write(&b, 1, 1);
+}
+
+// Passes everything written so far on to the callback
+static int sink_flush(void)
+{
+    struct jpeg_output_sink *sink = &iceenv.sink;
+
+    if (!sink->error && sink->type == SINK_CALLBACK && sink->pending_size)
+    {
+        if (sink->callback(sink->user, sink->pending, sink->pending_size))
+            sink->error = ERR_WRITE_CALLBACK_FAILED;
+        sink->pending_size = 0;
+    }
+
+    return sink->error;
+}
+
+static int sink_close(void)
+{
+    struct jpeg_output_sink *sink = &iceenv.sink;
+    int err = sink_flush();
+
+    if (sink->type == SINK_FILE && sink->file)
+    {
+        if (fclose(sink->file) && !err)
+            err = ERR_CANNOT_OPEN_OUTPUT_FILE;
+        sink->file = 0;
+    }
+
+    return err;
+}
+
+// The output functions must be called after icejpeg_encode_init() or
+// icejpeg_encode_begin() and before the first data is written.
+
+// The encoder allocates and grows *buffer as required; the caller has to
+// free() it once it is done with the data.
+void icejpeg_set_output_memory(unsigned char **buffer, int *size)
+{
+    iceenv.sink.type = SINK_MEMORY;
+    iceenv.sink.buffer = buffer;
+    iceenv.sink.size = size;
+    *buffer = 0;
+    *size = 0;
+}
+
+// Writes into a caller-supplied buffer, fails with ERR_OUTPUT_BUFFER_TOO_SMALL
+// if the data doesn't fit
+void icejpeg_set_output_buffer(unsigned char *buffer, int capacity, int *size)
+{
+    iceenv.sink.type = SINK_BUFFER;
+    iceenv.sink.data = buffer;
+    iceenv.sink.capacity = capacity;
+    iceenv.sink.size = size;
+    *size = 0;
+}
+
+// Data is passed to the callback in pieces, at the latest at every restart
+// marker (or MCU row when encoding incrementally) and at the end of the image
+int icejpeg_set_output_callback(icejpeg_write_callback callback, void *user)
+{
+    if (!iceenv.sink.pending)
+    {
+        iceenv.sink.pending_capacity = 0x1000;
+        iceenv.sink.pending = (byte*) malloc(iceenv.sink.pending_capacity);
+        if (!iceenv.sink.pending)
+            return ERR_OUT_OF_MEMORY;
+    }
+    iceenv.sink.type = SINK_CALLBACK;
+    iceenv.sink.callback = callback;
+    iceenv.sink.user = user;
+    iceenv.sink.pending_size = 0;
+    return ERR_OK;
+}
+
 //************************************************************
 // FILE WRITING FUNCTIONS
 //************************************************************
-static int write_app0(FILE *f)
+static int write_app0(void)
 {
     word marker = 0xE0FF;
     word length = FLIP(sizeof(struct jpeg_app0) + 2);
@@ -1362,45 +4227,69 @@ static int write_app0(FILE *f)
     app0.xy_dens_unit = 1;
     app0.xdensity = app0.ydensity = FLIP(72);
     
-    fwrite(&marker, sizeof(word), 1, f);
-    fwrite(&length, sizeof(word), 1, f);
-    fwrite(&app0, sizeof(byte), sizeof(struct jpeg_app0), f);
+    sink_write(&marker, sizeof(word), 1);
+    sink_write(&length, sizeof(word), 1);
+    sink_write(&app0, sizeof(byte), sizeof(struct jpeg_app0));
     
     return ERR_OK;
 }
 
-static int write_dqt(FILE *f)
+// Writes the APPn and COM segments that came with coefficient input
+static int write_metadata(void)
+{
+    if (iceenv.input_coefs && iceenv.input_coefs->metadata_size > 0)
+        sink_write(iceenv.input_coefs->metadata, sizeof(byte), iceenv.input_coefs->metadata_size);
+
+    return ERR_OK;
+}
+
+// Checks whether the metadata of coefficient input has an APP0 segment
+static int has_app0_metadata(void)
+{
+    const byte *data = iceenv.input_coefs ? iceenv.input_coefs->metadata : 0;
+    int pos = 0, size = iceenv.input_coefs ? iceenv.input_coefs->metadata_size : 0;
+
+    while (data && pos + 4 <= size)
+    {
+        if (data[pos + 1] == 0xE0)
+            return 1;
+        pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+    }
+    return 0;
+}
+
+static int write_dqt(void)
 {
     word marker = 0xDBFF;
-    word length = FLIP(2 * 65 + 2);
+    word length = FLIP(iceenv.num_quant_tables * 65 + 2);
     
-    byte qtbl_lum[64];
-    byte qtbl_chr[64];
-    int i =0;
-	for (i = 0; i < 64; i++)
-		qtbl_lum[jpeg_zzleft[i]] = CLAMPQNT((iceenv.quality_scale_factor * jpeg_qtbl_luminance[i] + 50) / 100);
-    for (i = 0; i < 64; i++)
-        qtbl_chr[jpeg_zzleft[i]] = CLAMPQNT((iceenv.quality_scale_factor * jpeg_qtbl_chrominance[i] + 50) / 100);
+    byte qtbl[64];
+    int i, j;
     
-    fwrite(&marker, sizeof(word), 1, f);
-    fwrite(&length, sizeof(word), 1, f);
-    fputc('\0', f);
-    fwrite(qtbl_lum, sizeof(byte), 64, f);
-    fputc('\1', f);
-    fwrite(qtbl_chr, sizeof(byte), 64, f);
+    sink_write(&marker, sizeof(word), 1);
+    sink_write(&length, sizeof(word), 1);
+    
+    // Table i holds the factors of component i
+    for (i = 0; i < iceenv.num_quant_tables; i++)
+    {
+        for (j = 0; j < 64; j++)
+            qtbl[jpeg_zzleft[j]] = (byte)iceenv.quant_factor[i][j];
+        sink_write_byte((byte)i);
+        sink_write(qtbl, sizeof(byte), 64);
+    }
     
     return ERR_OK;
 }
 
-static int write_dht(FILE *f)
+static int write_dht(void)
 {
     int num_tables = iceenv.num_components * 2;
     
     word marker = 0xC4FF;
     word length = FLIP(num_tables + num_tables*16 + (iceenv.dc_huff_numcodes[0] + iceenv.dc_huff_numcodes[1] + iceenv.dc_huff_numcodes[2] + iceenv.ac_huff_numcodes[0] + iceenv.ac_huff_numcodes[1]  + iceenv.ac_huff_numcodes[2]) + 2);
     
-    fwrite(&marker, sizeof(word), 1, f);
-    fwrite(&length, sizeof(word), 1, f);
+    sink_write(&marker, sizeof(word), 1);
+    sink_write(&length, sizeof(word), 1);
     
     byte info = 0;
     
@@ -1409,22 +4298,23 @@ static int write_dht(FILE *f)
 	{
 		info = i;
 
-		fputc(info, f);
-		fwrite(icecomp[i].dc_dht.num_codes, sizeof(byte), 16, f);
-		fwrite(icecomp[i].dc_dht.codes, sizeof(byte), iceenv.dc_huff_numcodes[i], f);
+		sink_write_byte(info);
+		sink_write(icecomp[i].dc_dht.num_codes, sizeof(byte), 16);
+		sink_write(icecomp[i].dc_dht.codes, sizeof(byte), iceenv.dc_huff_numcodes[i]);
 
 		info |= 16;
-		fputc(info, f);
-		fwrite(icecomp[i].ac_dht.num_codes, sizeof(byte), 16, f);
-		fwrite(icecomp[i].ac_dht.codes, sizeof(byte), iceenv.ac_huff_numcodes[i], f);
+		sink_write_byte(info);
+		sink_write(icecomp[i].ac_dht.num_codes, sizeof(byte), 16);
+		sink_write(icecomp[i].ac_dht.codes, sizeof(byte), iceenv.ac_huff_numcodes[i]);
 	}
     
     return ERR_OK;
 }
 
-static int write_sof0(FILE *f)
+// Writes the SOF0 marker, or SOF2 for a progressive image
+static int write_sof0(void)
 {
-    word marker = 0xC0FF;
+    word marker = iceenv.progressive ? 0xC2FF : 0xC0FF;
     word length = FLIP(8 + iceenv.num_components * 3);
     
     struct jpeg_sof0 sof0;
@@ -1434,94 +4324,163 @@ static int write_sof0(FILE *f)
     sof0.height = FLIP(iceenv.height);
     sof0.precision = 8;
     
-    fwrite(&marker, sizeof(word), 1, f);
-    fwrite(&length, sizeof(word), 1, f);
+    sink_write(&marker, sizeof(word), 1);
+    sink_write(&length, sizeof(word), 1);
     
-    fwrite(&sof0, sizeof(byte), sizeof(sof0), f);
+    sink_write(&sof0, sizeof(byte), sizeof(sof0));
     
     int i = 0;
     for (i = 0; i < iceenv.num_components; i++)
     {
         struct jpeg_sof0_component_info compinfo;
         compinfo.id = i + 1;
-        compinfo.qt_table = !i ? 0 : 1;
-        compinfo.sampling_factors = (icecomp[i].sy << 4) | icecomp[i].sx;
+        compinfo.qt_table = min(i, iceenv.num_quant_tables - 1);
+        compinfo.sampling_factors = (icecomp[i].sx << 4) | icecomp[i].sy;
         
-        fwrite(&compinfo, sizeof(byte), sizeof(compinfo), f);
+        sink_write(&compinfo, sizeof(byte), sizeof(compinfo));
     }
     
     return ERR_OK;
 }
 
-static int write_sos(FILE *f)
+static int write_sos(void)
 {
     word marker = 0xDAFF;
     word length = FLIP(6 + 2*iceenv.num_components);
     
-    fwrite(&marker, sizeof(word), 1, f);
-    fwrite(&length, sizeof(word), 1, f);
+    sink_write(&marker, sizeof(word), 1);
+    sink_write(&length, sizeof(word), 1);
     
-    fputc((byte) iceenv.num_components, f);
+    sink_write_byte((byte) iceenv.num_components);
     
     int i = 0;
     for (i = 0; i < iceenv.num_components; i++)
     {
-        fputc((byte) i + 1, f);
+        sink_write_byte((byte) i + 1);
         byte huff_table_selector = (i << 4) | i;
-        fputc((byte) huff_table_selector, f);
+        sink_write_byte((byte) huff_table_selector);
     }
     
-    fputc('\0', f);	// Spectral selection: start
-	fputc(63, f); // Spectral selection: end
-	fputc('\0', f); // Successive approximation
-
-    fwrite(iceenv.scan_buffer, sizeof(byte), iceenv.buf_pos, f);
+    sink_write_byte('\0');	// Spectral selection: start
+	sink_write_byte(63); // Spectral selection: end
+	sink_write_byte('\0'); // Successive approximation
     
     return ERR_OK;
 }
 
-static int write_dri(FILE *f)
+// Writes the Huffman tables used by a progressive scan, which were built
+// for it right before
+static int write_scan_dht(const struct jpeg_scan_info *scan)
+{
+    int length = 2;
+    int i;
+
+    for (i = 0; i < scan->num_components; i++)
+    {
+        int comp = scan->component[i];
+        length += 17 + (!scan->ss ? iceenv.dc_huff_numcodes[comp] : iceenv.ac_huff_numcodes[comp]);
+    }
+
+    word marker = 0xC4FF;
+    word flipped_length = FLIP(length);
+    sink_write(&marker, sizeof(word), 1);
+    sink_write(&flipped_length, sizeof(word), 1);
+
+    for (i = 0; i < scan->num_components; i++)
+    {
+        int comp = scan->component[i];
+        struct jpeg_dht *dht = !scan->ss ? &icecomp[comp].dc_dht : &icecomp[comp].ac_dht;
+
+        sink_write_byte((byte)(!scan->ss ? comp : (comp | 16)));
+        sink_write(dht->num_codes, sizeof(byte), 16);
+        sink_write(dht->codes, sizeof(byte), !scan->ss ? iceenv.dc_huff_numcodes[comp] : iceenv.ac_huff_numcodes[comp]);
+    }
+
+    return ERR_OK;
+}
+
+// Writes the SOS marker of a progressive scan. Only spectral selection is
+// used, there is no successive approximation.
+static int write_scan_sos(const struct jpeg_scan_info *scan)
+{
+    word marker = 0xDAFF;
+    word length = FLIP(6 + 2*scan->num_components);
+    int i;
+
+    sink_write(&marker, sizeof(word), 1);
+    sink_write(&length, sizeof(word), 1);
+
+    sink_write_byte((byte) scan->num_components);
+    for (i = 0; i < scan->num_components; i++)
+    {
+        int comp = scan->component[i];
+        sink_write_byte((byte) comp + 1);
+        sink_write_byte((byte) ((comp << 4) | comp));
+    }
+
+    sink_write_byte((byte) scan->ss);
+    sink_write_byte((byte) scan->se);
+    sink_write_byte('\0');
+
+    return ERR_OK;
+}
+
+static int write_dri(void)
 {
     word marker = 0xDDFF;
     word length = FLIP(4);
     
-    fwrite(&marker, sizeof(word), 1, f);
-    fwrite(&length, sizeof(word), 1, f);
+    sink_write(&marker, sizeof(word), 1);
+    sink_write(&length, sizeof(word), 1);
     
-    // For now we'll output a restart marker after every line of MCUs
     word rst_int = FLIP(iceenv.restart_interval);
     
-    fwrite(&rst_int, sizeof(word), 1, f);
+    sink_write(&rst_int, sizeof(word), 1);
     
     return ERR_OK;
 }
 
-static int write_to_file(void)
+// Writes everything in front of the entropy coded data
+static int write_headers(void)
 {
-    FILE *f;
-    f = fopen(iceenv.outfile, "wb");
-    if (!f)
-    {
-        return ERR_CANNOT_OPEN_OUTPUT_FILE;
-    }
-    
+    int err = sink_open();
+    if (err)
+        return err;
+
     word marker = 0xD8FF;
-    fwrite(&marker, sizeof(word), 1, f);
+    sink_write(&marker, sizeof(word), 1);
     
-    write_app0(f);
-    write_dqt(f);
-    write_dht(f);
+    // The APP0 segment of coefficient input is kept
+    if (!has_app0_metadata())
+        write_app0();
+    write_metadata();
+    write_dqt();
+    // The scans of a progressive image come with their own tables
+    if (!iceenv.progressive)
+        write_dht();
     if (iceenv.use_rst_markers)
-        write_dri(f);
-    write_sof0(f);
-    write_sos(f);
-    
-    marker = 0xD9FF;
-    fwrite(&marker, sizeof(word), 1, f);
-    
-    fclose(f);
+        write_dri();
+    write_sof0();
+    if (!iceenv.progressive)
+        write_sos();
+
+    iceenv.headers_written = 1;
+
+    return iceenv.sink.error;
+}
+
+// Writes the EOI marker and closes the output
+static int write_trailer(void)
+{
+    word marker = 0xD9FF;
+    sink_write(&marker, sizeof(word), 1);
+
+#ifdef _JPEG_ENCODER_STATS
+    icestats.file_size = iceenv.sink.bytes_written;
+    icestats.quality = iceenv.quality;
+#endif
     
-    return ERR_OK;
+    return sink_close();
 }
 
 
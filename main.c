@@ -75,19 +75,40 @@ int main(int argc, const char** argv)
     }
 
 	struct jpeg_encoder_settings settings;
+	memset(&settings, 0, sizeof(settings));
 	settings.width = img_width;
 	settings.height = img_height;
 	settings.num_components = 3;
 	settings.quality = 10;
 	settings.use_rst_markers = 0;
+	settings.restart_interval = 0;
 	settings.sampling_factors[0].sx = 2;
     settings.sampling_factors[0].sy = 2;
 	settings.sampling_factors[1].sx = 1;
 	settings.sampling_factors[1].sy = 1;
 	settings.sampling_factors[2].sx = 1;
 	settings.sampling_factors[2].sy = 1;
+	settings.num_threads = 1;
+	settings.preset = ICEJPEG_PRESET_BALANCED;
+	settings.input_format = ICEJPEG_INPUT_RGB;
+	settings.sampled_huffman_tables = 0;
+	settings.block_cache = 0;
+	settings.target_size = 0;
+	settings.frame_budget = 0;
+	settings.trellis_quantization = 0;
+	settings.progressive = 0;
+	settings.scan_script = 0;
+	settings.num_scans = 0;
 
-	icejpeg_encode_init("out.jpg", my_image, &settings);
+	err = icejpeg_encode_init("out.jpg", my_image, &settings);
+	if (err != ERR_OK)
+	{
+		printf("Error setting up the encoder: %d\n", err);
+		icejpeg_encode_cleanup();
+		free((void*)my_image);
+		icejpeg_cleanup();
+		return err;
+	}
 	err = icejpeg_write();
     
     struct jpeg_encoder_stats *stats;
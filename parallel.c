@@ -0,0 +1,213 @@
+//  *************************************************************************************
+//
+//  parallel.c
+//
+//  version 1.0
+//  01/23/2016
+//  Written by Matthias Grün
+//  m.gruen@theicingonthecode.com
+//
+//  IceJPEG is open source and may be used freely, as long as the original author
+//  of the code is mentioned.
+//
+//  You may redistribute it freely as long as no fees are charged and this information
+//  is included.
+//
+//  If modifications are made to the code that alter its behavior and the modified code
+//  is made available to others or used in other products, the author is to receive
+//  a copy of the modified code.
+//
+//  This code is provided as is and I do not and cannot guarantee the absence of bugs.
+//  Use of this code is at your own risk and I cannot be held liable for any
+//  damage that is caused by its use.
+//
+//  *************************************************************************************
+//
+//  This file contains the little bit of threading support the encoder needs
+//  to spread its work over several cores. POSIX threads and Win32 threads
+//  are supported.
+//
+//  *************************************************************************************
+
+#include "parallel.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+typedef HANDLE ice_thread;
+
+struct ice_thread_start
+{
+    ice_thread_func func;
+    void *arg;
+};
+
+static DWORD WINAPI thread_main(LPVOID param)
+{
+    struct ice_thread_start *start = (struct ice_thread_start*)param;
+    start->func(start->arg);
+    return 0;
+}
+#else
+typedef pthread_t ice_thread;
+
+struct ice_thread_start
+{
+    ice_thread_func func;
+    void *arg;
+};
+
+static void *thread_main(void *param)
+{
+    struct ice_thread_start *start = (struct ice_thread_start*)param;
+    start->func(start->arg);
+    return 0;
+}
+#endif
+
+void ice_run_parallel(ice_thread_func func, void *args, int arg_size, int count)
+{
+    int i;
+
+    if (count < 2)
+    {
+        if (count == 1)
+            func(args);
+        return;
+    }
+
+    ice_thread *threads = (ice_thread*)malloc(sizeof(ice_thread) * count);
+    struct ice_thread_start *starts = (struct ice_thread_start*)malloc(sizeof(struct ice_thread_start) * count);
+    int *started = (int*)calloc(count, sizeof(int));
+
+    if (!threads || !starts || !started)
+    {
+        // Not even enough memory for the bookkeeping, do it all on this thread
+        for (i = 0; i < count; i++)
+            func((char*)args + i * arg_size);
+        free(threads);
+        free(starts);
+        free(started);
+        return;
+    }
+
+    for (i = 1; i < count; i++)
+    {
+        starts[i].func = func;
+        starts[i].arg = (char*)args + i * arg_size;
+#ifdef _WIN32
+        threads[i] = CreateThread(0, 0, thread_main, &starts[i], 0, 0);
+        started[i] = threads[i] != 0;
+#else
+        started[i] = !pthread_create(&threads[i], 0, thread_main, &starts[i]);
+#endif
+    }
+
+    func(args);
+
+    for (i = 1; i < count; i++)
+    {
+        if (!started[i])
+        {
+            // Couldn't create the thread, so this one is done here as well
+            func(starts[i].arg);
+            continue;
+        }
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], 0);
+#endif
+    }
+
+    free(threads);
+    free(starts);
+    free(started);
+}
+
+#ifdef _WIN32
+
+int ice_mutex_init(ice_mutex *mutex)
+{
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+
+void ice_mutex_lock(ice_mutex *mutex)
+{
+    EnterCriticalSection(mutex);
+}
+
+void ice_mutex_unlock(ice_mutex *mutex)
+{
+    LeaveCriticalSection(mutex);
+}
+
+void ice_mutex_destroy(ice_mutex *mutex)
+{
+    DeleteCriticalSection(mutex);
+}
+
+int ice_cond_init(ice_cond *cond)
+{
+    InitializeConditionVariable(cond);
+    return 0;
+}
+
+void ice_cond_wait(ice_cond *cond, ice_mutex *mutex)
+{
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+void ice_cond_broadcast(ice_cond *cond)
+{
+    WakeAllConditionVariable(cond);
+}
+
+void ice_cond_destroy(ice_cond *cond)
+{
+}
+
+#else
+
+int ice_mutex_init(ice_mutex *mutex)
+{
+    return pthread_mutex_init(mutex, 0);
+}
+
+void ice_mutex_lock(ice_mutex *mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+void ice_mutex_unlock(ice_mutex *mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+void ice_mutex_destroy(ice_mutex *mutex)
+{
+    pthread_mutex_destroy(mutex);
+}
+
+int ice_cond_init(ice_cond *cond)
+{
+    return pthread_cond_init(cond, 0);
+}
+
+void ice_cond_wait(ice_cond *cond, ice_mutex *mutex)
+{
+    pthread_cond_wait(cond, mutex);
+}
+
+void ice_cond_broadcast(ice_cond *cond)
+{
+    pthread_cond_broadcast(cond);
+}
+
+void ice_cond_destroy(ice_cond *cond)
+{
+    pthread_cond_destroy(cond);
+}
+
+#endif
@@ -0,0 +1,61 @@
+//  *************************************************************************************
+//
+//  parallel.h
+//
+//  version 1.0
+//  01/23/2016
+//  Written by Matthias Grün
+//  m.gruen@theicingonthecode.com
+//
+//  IceJPEG is open source and may be used freely, as long as the original author
+//  of the code is mentioned.
+//
+//  You may redistribute it freely as long as no fees are charged and this information
+//  is included.
+//
+//  If modifications are made to the code that alter its behavior and the modified code
+//  is made available to others or used in other products, the author is to receive
+//  a copy of the modified code.
+//
+//  This code is provided as is and I do not and cannot guarantee the absence of bugs.
+//  Use of this code is at your own risk and I cannot be held liable for any
+//  damage that is caused by its use.
+//
+//  *************************************************************************************
+
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION ice_mutex;
+typedef CONDITION_VARIABLE ice_cond;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t ice_mutex;
+typedef pthread_cond_t ice_cond;
+#endif
+
+typedef void (*ice_thread_func)(void *arg);
+
+// Calls func once for each of the count consecutive arguments of size
+// arg_size starting at args, each call on its own thread. The first call
+// is made on the calling thread. Returns when all calls are done.
+// Calls that couldn't get a thread of their own are made on the calling thread
+// after the first one returned. So the first call must never wait for the
+// others to make progress; the others may wait for the first one, as long as
+// they don't have to wait anymore once it returned.
+void ice_run_parallel(ice_thread_func func, void *args, int arg_size, int count);
+
+// Mutexes and condition variables, the init functions return 0 on success
+int ice_mutex_init(ice_mutex *mutex);
+void ice_mutex_lock(ice_mutex *mutex);
+void ice_mutex_unlock(ice_mutex *mutex);
+void ice_mutex_destroy(ice_mutex *mutex);
+
+int ice_cond_init(ice_cond *cond);
+void ice_cond_wait(ice_cond *cond, ice_mutex *mutex);
+void ice_cond_broadcast(ice_cond *cond);
+void ice_cond_destroy(ice_cond *cond);
+
+#endif
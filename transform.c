@@ -0,0 +1,288 @@
+//  *************************************************************************************
+//
+//  transform.c
+//
+//  version 1.0
+//  01/23/2016
+//  Written by Matthias Grün
+//  m.gruen@theicingonthecode.com
+//
+//  IceJPEG is open source and may be used freely, as long as the original author
+//  of the code is mentioned.
+//
+//  You may redistribute it freely as long as no fees are charged and this information
+//  is included.
+//
+//  If modifications are made to the code that alter its behavior and the modified code
+//  is made available to others or used in other products, the author is to receive
+//  a copy of the modified code.
+//
+//  This code is provided as is and I do not and cannot guarantee the absence of bugs.
+//  Use of this code is at your own risk and I cannot be held liable for any
+//  damage that is caused by its use.
+//
+//  *************************************************************************************
+//
+//  This file contains the lossless transforms, which rotate and flip an image
+//  by rearranging its quantized DCT coefficients, and the lossless recoding of
+//  a file with optimized Huffman tables.
+//
+//  *************************************************************************************
+
+#include "transform.h"
+#include "decode.h"
+#include "encode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Mirroring the image horizontally mirrors each block as well, which
+// negates the coefficients of odd horizontal frequency; mirroring it
+// vertically negates those of odd vertical frequency. Transposing the image
+// transposes each block and the quantization tables.
+int icejpeg_transform_coefficients(const struct jpeg_coefficients *src, struct jpeg_coefficients *dst, int transform)
+{
+	int transpose, mirror_x, mirror_y, negate_u, negate_v;
+	int max_sx = 1, max_sy = 1;
+	int width = src->width, height = src->height;
+	int i, k, x, y;
+	byte src_index[64];
+	short sign[64];
+
+	memset(dst, 0, sizeof(struct jpeg_coefficients));
+
+	if (transform < ICEJPEG_TRANSFORM_NONE || transform > ICEJPEG_TRANSFORM_ROTATE_270 ||
+		src->num_components < 1 || src->num_components > 3)
+		return ERR_INVALID_SETTINGS;
+
+	transpose = transform == ICEJPEG_TRANSFORM_TRANSPOSE || transform == ICEJPEG_TRANSFORM_ROTATE_90 ||
+		transform == ICEJPEG_TRANSFORM_ROTATE_270;
+	// Mirrored directions of the source image
+	mirror_x = transform == ICEJPEG_TRANSFORM_FLIP_H || transform == ICEJPEG_TRANSFORM_ROTATE_180 ||
+		transform == ICEJPEG_TRANSFORM_ROTATE_270;
+	mirror_y = transform == ICEJPEG_TRANSFORM_FLIP_V || transform == ICEJPEG_TRANSFORM_ROTATE_180 ||
+		transform == ICEJPEG_TRANSFORM_ROTATE_90;
+	// ... and of the blocks of the result
+	negate_u = transpose ? mirror_y : mirror_x;
+	negate_v = transpose ? mirror_x : mirror_y;
+
+	for (i = 0; i < src->num_components; i++)
+	{
+		if (src->planes[i].sx < 1 || src->planes[i].sy < 1)
+			return ERR_INVALID_SAMPLING_FACTOR;
+		max_sx = max(max_sx, src->planes[i].sx);
+		max_sy = max(max_sy, src->planes[i].sy);
+	}
+
+	// Only whole MCUs can be mirrored
+	if (mirror_x)
+		width -= width % (8 * max_sx);
+	if (mirror_y)
+		height -= height % (8 * max_sy);
+	if (width <= 0 || height <= 0)
+		return ERR_INVALID_SETTINGS;
+
+	for (k = 0; k < 64; k++)
+	{
+		int u = k & 7, v = k >> 3;
+		src_index[k] = transpose ? (u << 3) | v : k;
+		sign[k] = ((negate_u && (u & 1)) ^ (negate_v && (v & 1))) ? -1 : 1;
+	}
+
+	dst->width = transpose ? height : width;
+	dst->height = transpose ? width : height;
+	dst->num_components = src->num_components;
+	dst->progressive = src->progressive;
+	// dst->metadata stays 0, see transform.h
+
+	for (i = 0; i < src->num_components; i++)
+	{
+		const struct jpeg_coefficient_plane *from = &src->planes[i];
+		struct jpeg_coefficient_plane *to = &dst->planes[i];
+		// Blocks of the source component inside whole MCUs
+		int blocks_x = width / (8 * max_sx) * from->sx;
+		int blocks_y = height / (8 * max_sy) * from->sy;
+
+		to->sx = transpose ? from->sy : from->sx;
+		to->sy = transpose ? from->sx : from->sy;
+		to->blocks_x = (dst->width + 8 * (transpose ? max_sy : max_sx) - 1) / (8 * (transpose ? max_sy : max_sx)) * to->sx;
+		to->blocks_y = (dst->height + 8 * (transpose ? max_sx : max_sy) - 1) / (8 * (transpose ? max_sx : max_sy)) * to->sy;
+		for (k = 0; k < 64; k++)
+			to->quant_table[k] = from->quant_table[src_index[k]];
+
+		to->coefs = (short*)calloc((size_t)to->blocks_x * to->blocks_y * 64, sizeof(short));
+		if (!to->coefs)
+		{
+			icejpeg_free_coefficients(dst);
+			return ERR_OUT_OF_MEMORY;
+		}
+
+		for (y = 0; y < to->blocks_y; y++)
+		{
+			for (x = 0; x < to->blocks_x; x++)
+			{
+				int bx = transpose ? y : x, by = transpose ? x : y;
+				const short *block;
+				short *out = to->coefs + ((size_t)y * to->blocks_x + x) * 64;
+
+				if (mirror_x)
+					bx = blocks_x - 1 - bx;
+				if (mirror_y)
+					by = blocks_y - 1 - by;
+				// Padding blocks beyond the source stay 0
+				if (bx < 0 || by < 0 || bx >= from->blocks_x || by >= from->blocks_y)
+					continue;
+
+				block = from->coefs + ((size_t)by * from->blocks_x + bx) * 64;
+				for (k = 0; k < 64; k++)
+					out[k] = sign[k] * block[src_index[k]];
+			}
+		}
+	}
+
+	return ERR_OK;
+}
+
+void icejpeg_free_coefficients(struct jpeg_coefficients *coefficients)
+{
+	int i;
+	for (i = 0; i < 3; i++)
+	{
+		free(coefficients->planes[i].coefs);
+		coefficients->planes[i].coefs = 0;
+	}
+}
+
+int icejpeg_transform_file(const char *src_filename, char *dst_filename, int transform, struct jpeg_encoder_settings *settings)
+{
+	struct jpeg_coefficients src, dst;
+	struct jpeg_encoder_settings defaults;
+	int err;
+
+	memset(&dst, 0, sizeof(dst));
+
+	err = icejpeg_decode_init(src_filename);
+	if (err == ERR_OK)
+		err = icejpeg_read_coefficients(&src);
+	if (err == ERR_OK)
+		err = icejpeg_transform_coefficients(&src, &dst, transform);
+	// The transformed planes are copies, the decoder's aren't needed anymore
+	icejpeg_cleanup();
+	if (err)
+		return err;
+
+	if (!settings)
+	{
+		memset(&defaults, 0, sizeof(defaults));
+		settings = &defaults;
+	}
+
+	err = icejpeg_encode_init_coefficients(dst_filename, &dst, settings);
+	if (err == ERR_OK)
+		err = icejpeg_write();
+	icejpeg_encode_cleanup();
+	icejpeg_free_coefficients(&dst);
+
+	return err;
+}
+
+int icejpeg_optimize(const unsigned char *data, int size, unsigned char **buffer, int *out_size)
+{
+	struct jpeg_coefficients coefficients;
+	struct jpeg_encoder_settings settings;
+	int err;
+
+	*buffer = 0;
+	*out_size = 0;
+
+	// Only the entropy coded data is decoded
+	icejpeg_decode_begin();
+	err = icejpeg_read_coefficients(&coefficients);
+	if (err == ERR_NEED_MORE_DATA)
+	{
+		err = icejpeg_decode_push(data, size);
+		if (err == ERR_OK)
+			err = icejpeg_read_coefficients(&coefficients);
+	}
+
+	if (err == ERR_OK)
+	{
+		memset(&settings, 0, sizeof(settings));
+		settings.progressive = coefficients.progressive;
+		err = icejpeg_encode_init_coefficients(0, &coefficients, &settings);
+		if (err == ERR_OK)
+		{
+			icejpeg_set_output_memory(buffer, out_size);
+			err = icejpeg_write();
+		}
+		icejpeg_encode_cleanup();
+	}
+	icejpeg_cleanup();
+
+	if (err)
+	{
+		free(*buffer);
+		*buffer = 0;
+		*out_size = 0;
+		return err;
+	}
+
+	// Files that were optimized already are passed through
+	if (*out_size >= size)
+	{
+		unsigned char *copy = (unsigned char*)realloc(*buffer, size);
+		if (!copy)
+		{
+			free(*buffer);
+			*buffer = 0;
+			*out_size = 0;
+			return ERR_OUT_OF_MEMORY;
+		}
+		memcpy(copy, data, size);
+		*buffer = copy;
+		*out_size = size;
+	}
+
+	return ERR_OK;
+}
+
+int icejpeg_optimize_file(const char *src_filename, const char *dst_filename)
+{
+	FILE *file;
+	unsigned char *data, *buffer;
+	long size;
+	int out_size, err;
+
+	file = fopen(src_filename, "rb");
+	if (!file)
+		return ERR_OPENFILE_FAILED;
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data = (unsigned char*)malloc(size > 0 ? size : 1);
+	if (!data)
+	{
+		fclose(file);
+		return ERR_OUT_OF_MEMORY;
+	}
+	size = (long)fread(data, 1, size > 0 ? size : 0, file);
+	fclose(file);
+
+	err = icejpeg_optimize(data, (int)size, &buffer, &out_size);
+	free(data);
+	if (err)
+		return err;
+
+	file = fopen(dst_filename, "wb");
+	if (!file)
+	{
+		free(buffer);
+		return ERR_CANNOT_OPEN_OUTPUT_FILE;
+	}
+	if (fwrite(buffer, 1, out_size, file) != (size_t)out_size)
+		err = ERR_CANNOT_OPEN_OUTPUT_FILE;
+	fclose(file);
+	free(buffer);
+
+	return err;
+}
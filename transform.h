@@ -0,0 +1,69 @@
+//  *************************************************************************************
+//
+//  transform.h
+//
+//  version 1.0
+//  01/23/2016
+//  Written by Matthias Grün
+//  m.gruen@theicingonthecode.com
+//
+//  IceJPEG is open source and may be used freely, as long as the original author
+//  of the code is mentioned.
+//
+//  You may redistribute it freely as long as no fees are charged and this information
+//  is included.
+//
+//  If modifications are made to the code that alter its behavior and the modified code
+//  is made available to others or used in other products, the author is to receive
+//  a copy of the modified code.
+//
+//  This code is provided as is and I do not and cannot guarantee the absence of bugs.
+//  Use of this code is at your own risk and I cannot be held liable for any
+//  damage that is caused by its use.
+//
+//  *************************************************************************************
+
+#ifndef _TRANSFORM_H
+#define _TRANSFORM_H
+
+#include "common.h"
+
+struct jpeg_encoder_settings;
+
+// Values of the transform parameter of icejpeg_transform_coefficients() and
+// icejpeg_transform_file(), rotations are clockwise
+#define ICEJPEG_TRANSFORM_NONE          0
+#define ICEJPEG_TRANSFORM_FLIP_H        1
+#define ICEJPEG_TRANSFORM_FLIP_V        2
+#define ICEJPEG_TRANSFORM_TRANSPOSE     3
+#define ICEJPEG_TRANSFORM_ROTATE_90     4
+#define ICEJPEG_TRANSFORM_ROTATE_180    5
+#define ICEJPEG_TRANSFORM_ROTATE_270    6
+
+// Rotates or flips quantized coefficients as returned by
+// icejpeg_read_coefficients() without decoding them: the blocks are moved
+// and their coefficients transposed and negated, the quantization tables
+// are transposed along with them. Nothing is lost, but a flip can only
+// mirror whole MCUs, so in a mirrored direction the partial MCUs at the
+// right or bottom edge are dropped, like jpegtran -trim does. dst gets
+// planes of its own that have to be freed with icejpeg_free_coefficients().
+// The metadata isn't taken over, its EXIF orientation would no longer apply.
+int icejpeg_transform_coefficients(const struct jpeg_coefficients *src, struct jpeg_coefficients *dst, int transform);
+void icejpeg_free_coefficients(struct jpeg_coefficients *coefficients);
+
+// Reads the coefficients of src_filename, transforms them and writes them
+// to dst_filename with icejpeg_encode_init_coefficients(), by default
+// (settings 0) as a baseline file with optimized Huffman tables
+int icejpeg_transform_file(const char *src_filename, char *dst_filename, int transform, struct jpeg_encoder_settings *settings);
+
+// Recodes a file with optimized Huffman tables. Only the Huffman codes are
+// decoded, the coefficients stay exactly the same; progressive files stay
+// progressive but get icejpeg's scans, restart markers are dropped. The
+// result is never larger than the input: files that can't be made smaller
+// come back unchanged. APPn segments (JFIF, EXIF, ICC profiles etc.) and
+// comments are copied as they are.
+// The result is allocated with malloc() and has to be freed by the caller.
+int icejpeg_optimize(const unsigned char *data, int size, unsigned char **buffer, int *out_size);
+int icejpeg_optimize_file(const char *src_filename, const char *dst_filename);
+
+#endif